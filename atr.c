@@ -0,0 +1,169 @@
+/*****************************************************************
+/
+/ File   :   atr.c
+/ Date   :   October 16, 2026
+/ Purpose:   ISO 7816-3 Answer To Reset decoding.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "atr.h"
+#include <string.h>
+
+static const unsigned int fi_table[16] = { 372, 372, 558, 744, 1116, 1488, 1860, 0, 0, 512, 768, 1024, 1536, 2048, 0, 0 };
+static const unsigned int di_table[16] = { 0, 1, 2, 4, 8, 16, 32, 64, 12, 20, 0, 0, 0, 0, 0, 0 };
+
+/* Clock rate conversion integer F for a TA1-coded byte, 0 if RFU */
+unsigned int atr_fi(UCHAR fidi) {
+    return fi_table[fidi >> 4];
+}
+
+/* Baud rate adjustment integer D for a TA1-coded byte, 0 if RFU */
+unsigned int atr_di(UCHAR fidi) {
+    return di_table[fidi & 0x0f];
+}
+
+static int count_bits(UCHAR y) {
+    return !!(y & 0x10) + !!(y & 0x20) + !!(y & 0x40) + !!(y & 0x80);
+}
+
+/* Returns the total length of the ATR starting with the length bytes given,
+   or -1 if more bytes are needed to know. The ATR only announces its length
+   piecewise through T0 and the TD bytes. */
+int atr_expected_length(const UCHAR *atr, DWORD length) {
+    if(length < 2) {
+        return -1;
+    }
+
+    DWORD i = 1; // T0
+    UCHAR y = atr[i] & 0xf0;
+    int k = atr[i] & 0x0f;
+    int tck = 0;
+    while(y & 0x80) {
+        // TDi is the last interface byte of this group
+        i += count_bits(y);
+        if(i >= length) {
+            return -1;
+        }
+        if(atr[i] & 0x0f) {
+            tck = 1;
+        }
+        y = atr[i] & 0xf0;
+    }
+    i += count_bits(y);
+    return i + 1 + k + tck;
+}
+
+/* Decodes the ATR into parsed. Returns 0 on success, or -1 if the ATR is
+   malformed, has the wrong length or a bad TCK. */
+int atr_parse(const UCHAR *atr, DWORD length, struct atr *parsed) {
+    memset(parsed, 0, sizeof(*parsed));
+    parsed->fidi = 0x11;
+    parsed->wi = 10;
+    parsed->ifsc = 32;
+    parsed->bwi = 4;
+    parsed->cwi = 13;
+
+    int expected = atr_expected_length(atr, length);
+    if(expected < 0 || (DWORD) expected != length || length > MAX_ATR_SIZE) {
+        return -1;
+    }
+    if(atr[0] != 0x3B && atr[0] != 0x3F) {
+        return -1;
+    }
+
+    DWORD i = 1;
+    UCHAR y = atr[i] & 0xf0;
+    int k = atr[i] & 0x0f;
+    int level = 1;
+    int protocol = 0; // protocol the current group of interface bytes belongs to
+    int first_t1 = 1;
+    int tck = 0;
+    i++;
+
+    for(;;) {
+        UCHAR ta = 0, tb = 0, tc = 0, td = 0;
+        int has_ta = 0, has_tb = 0, has_tc = 0;
+        if(y & 0x10) {
+            ta = atr[i++];
+            has_ta = 1;
+        }
+        if(y & 0x20) {
+            tb = atr[i++];
+            has_tb = 1;
+        }
+        if(y & 0x40) {
+            tc = atr[i++];
+            has_tc = 1;
+        }
+        if(y & 0x80) {
+            td = atr[i++];
+        }
+
+        if(level == 1) {
+            if(has_ta) {
+                parsed->fidi = ta;
+                parsed->has_ta1 = 1;
+            }
+            if(has_tc) {
+                parsed->n = tc;
+            }
+        } else if(level == 2) {
+            if(has_ta) {
+                parsed->specific_mode = 1;
+                parsed->implicit = !!(ta & 0x10);
+                parsed->protocol = ta & 0x0f;
+            }
+            if(has_tc) {
+                parsed->wi = tc;
+            }
+        } else if(protocol == 1 && first_t1) {
+            if(has_ta) {
+                parsed->ifsc = ta;
+            }
+            if(has_tb) {
+                parsed->bwi = tb >> 4;
+                parsed->cwi = tb & 0x0f;
+            }
+            if(has_tc) {
+                parsed->crc = tc & 0x01;
+            }
+            first_t1 = 0;
+        }
+
+        if(!(y & 0x80)) {
+            break;
+        }
+        protocol = td & 0x0f;
+        if(protocol != 15) {
+            parsed->protocols |= ATR_PROTOCOL(protocol);
+        }
+        if(protocol != 0) {
+            tck = 1;
+        }
+        if(level == 1 && !parsed->specific_mode) {
+            parsed->protocol = protocol;
+        }
+        y = td & 0xf0;
+        level++;
+    }
+
+    if(!parsed->protocols) {
+        parsed->protocols = ATR_PROTOCOL(0);
+    }
+
+    memcpy(parsed->historical, &atr[i], k);
+    parsed->historical_length = k;
+
+    if(tck) {
+        UCHAR check = 0;
+        DWORD j;
+        for(j = 1; j < length; j++) {
+            check ^= atr[j];
+        }
+        if(check != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
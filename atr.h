@@ -0,0 +1,42 @@
+/*****************************************************************
+/
+/ File   :   atr.h
+/ Date   :   October 16, 2026
+/ Purpose:   ISO 7816-3 Answer To Reset decoding.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _atr_h_
+#define _atr_h_
+
+#include <wintypes.h>
+#include <pcsclite.h>
+
+#define ATR_PROTOCOL(t) (1 << (t)) /* bit in struct atr.protocols for T=t */
+
+/* Parameters of the card as announced in its ATR, with the ISO 7816-3
+   defaults filled in for interface bytes that are absent. */
+struct atr {
+    UCHAR fidi;         /* TA1: Fi in the high nibble, Di in the low nibble */
+    int has_ta1;
+    UCHAR n;            /* TC1: extra guard time in ETUs */
+    unsigned int protocols; /* ATR_PROTOCOL() bits of all offered protocols */
+    int protocol;       /* T of TD1, the protocol used without PPS */
+    int specific_mode;  /* TA2 present, PPS is not allowed */
+    int implicit;       /* TA2 b5: Fi/Di are implicit rather than from TA1 */
+    UCHAR wi;           /* TC2: T=0 work waiting integer */
+    UCHAR ifsc;         /* first TA for T=1: information field size */
+    UCHAR bwi;          /* first TB for T=1, high nibble */
+    UCHAR cwi;          /* first TB for T=1, low nibble */
+    int crc;            /* first TC for T=1 b1: CRC instead of LRC */
+    UCHAR historical[15];
+    int historical_length;
+};
+
+int atr_expected_length(const UCHAR *atr, DWORD length);
+int atr_parse(const UCHAR *atr, DWORD length, struct atr *parsed);
+unsigned int atr_fi(UCHAR fidi);
+unsigned int atr_di(UCHAR fidi);
+
+#endif
@@ -0,0 +1,124 @@
+/*****************************************************************
+/
+/ File   :   cr75.h
+/ Date   :   October 16, 2026
+/ Purpose:   Vendor specific tags and control codes of libcr75, for
+/            use with SCardGetAttrib/SCardSetAttrib and SCardControl.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _cr75_h_
+#define _cr75_h_
+
+#include <stdint.h>
+
+/* Attributes in the SCARD_CLASS_VENDOR_DEFINED class (7), pcscd passes
+   them unchanged to IFDHGetCapabilities/IFDHSetCapabilities */
+#define CR75_TAG(x) (0x00070000 | (x))
+
+/* 1 byte, read/write. How T=0 sends APDUs with more than 255 bytes of
+   command data: 0 splits them with command chaining (CLA b5), 1 wraps the
+   whole APDU into ENVELOPE commands. */
+#define TAG_CR75_T0_ENVELOPE CR75_TAG(0xA001)
+
+/* 1 byte, read/write, default 1. When set, T=0 answers 61xx with GET
+   RESPONSE and 6Cxx by repeating the command with the right Le inside the
+   driver, until the card returns a final status or Le bytes are collected. */
+#define TAG_CR75_T0_GET_RESPONSE CR75_TAG(0xA002)
+
+/* 1 byte, read/write, default 0 or the CR75_T0_COMBINED environment
+   variable. When set, T=0 sends the header and command data of a TPDU in
+   one write for instructions the card has acknowledged with an ACK right
+   after the header before, which saves a write and a read per command.
+   The CR-75 firmware is not known to hold the data back until the card
+   ACKs. A card that answers such a command with a status instead may take
+   the data for the next header, the command then fails with
+   IFD_COMMUNICATION_ERROR and the card should be reset. Only enable this
+   for cards known to accept the commands in use. */
+#define TAG_CR75_T0_COMBINED CR75_TAG(0xA006)
+
+/* 1 byte, write only, drivers built WITH_EMULATOR and running on the
+   emulator (CR75_EMULATOR=1): 1 inserts the emulated card, 0 removes it */
+#define TAG_CR75_EMULATOR_CARD CR75_TAG(0xA005)
+
+/* Same value as SCARD_CTL_CODE() of pcsclite */
+#define CR75_CTL_CODE(code) (0x42000000 + (code))
+
+/* Runs a list of APDUs back to back in one SCardControl call.
+
+   The input is a sequence of entries:
+     flags (1 byte), SW1 SW2 (2 bytes), APDU length (2 bytes, big endian),
+     APDU
+   The output holds one record per executed entry:
+     status (1 byte), response length (2 bytes, big endian), response
+
+   With CR75_BATCH_CHECK_SW an entry fails unless its response ends with
+   SW1 SW2 (only SW1 with CR75_BATCH_SW1_ONLY). With CR75_BATCH_STOP_ON_ERROR
+   the batch ends after a failed entry. The card stays locked to the caller
+   for the whole batch. */
+#define IOCTL_CR75_BATCH CR75_CTL_CODE(3500)
+
+#define CR75_BATCH_STOP_ON_ERROR 0x01
+#define CR75_BATCH_CHECK_SW 0x02
+#define CR75_BATCH_SW1_ONLY 0x04
+
+#define CR75_BATCH_HEADER_SIZE 5
+#define CR75_BATCH_RECORD_HEADER_SIZE 3
+
+/* Record status */
+#define CR75_BATCH_OK 0x00
+#define CR75_BATCH_SW_MISMATCH 0x01
+#define CR75_BATCH_TRANSMIT_ERROR 0x02
+
+#define CR75_METRICS_VERSION 1
+
+/* Bucket i counts durations of 2^i up to 2^(i+1) microseconds, bucket 0
+   also takes everything below 1 us and the last one everything above */
+#define CR75_HISTOGRAM_BUCKETS 24
+
+/* Counters of one reader since its channel was opened, in host byte order.
+   Fields are only ever appended, with version and size updated. */
+struct cr75_metrics {
+    uint32_t version;               /* CR75_METRICS_VERSION */
+    uint32_t size;                  /* sizeof(struct cr75_metrics) */
+    uint64_t apdus[8];              /* by case: malformed, 1, 2S, 3S, 4S, 2E, 3E, 4E */
+    uint64_t apdu_errors;           /* APDUs not ending in IFD_SUCCESS */
+    uint64_t bytes_out;             /* bulk OUT payload */
+    uint64_t bytes_in;              /* bulk IN payload */
+    uint64_t control_transfers;
+    uint64_t bulk_transfers;
+    uint64_t timeouts;              /* transfers failing with IFD_RESPONSE_TIMEOUT */
+    uint64_t no_device;             /* ... with IFD_NO_SUCH_DEVICE */
+    uint64_t communication_errors;  /* ... with IFD_COMMUNICATION_ERROR */
+    uint64_t power_ups;             /* IFD_POWER_UP and IFD_RESET */
+    uint64_t pps_exchanges;
+    uint64_t pps_failures;
+    uint64_t apdu_time[CR75_HISTOGRAM_BUCKETS]; /* IFDHTransmitToICC to response */
+    uint64_t pps_time[CR75_HISTOGRAM_BUCKETS];
+};
+
+/* Returns struct cr75_metrics, RxBuffer must hold all of it */
+#define IOCTL_CR75_METRICS CR75_CTL_CODE(3501)
+
+/* Read only, struct cr75_metrics truncated to the attribute buffer. pcscd
+   limits that to 264 bytes, which cuts off the histograms. */
+#define TAG_CR75_METRICS CR75_TAG(0xA003)
+
+/* 1 byte, read/write. Records every USB transfer (time, direction,
+   endpoint, length and the first bytes) in a ring of the last 256. Defaults
+   to the CR75_TRACE environment variable, or on in debug builds. */
+#define TAG_CR75_TRACE CR75_TAG(0xA004)
+
+/* Returns the trace ring as text, oldest transfer first, one per line:
+   "seconds.nanoseconds >|< endpoint length bytes [ascii]". Vendor requests
+   show as endpoint 00 with the request and wIndex before their data. */
+#define IOCTL_CR75_TRACE CR75_CTL_CODE(3502)
+
+/* Exported by the driver, find it with dlsym(). Writes the trace of every
+   open reader to fd in the IOCTL_CR75_TRACE format. Async-signal-safe, so
+   a crash or SIGUSR handler in the process hosting the driver may call it.
+   Returns 0, or -1 if a write failed. */
+int cr75_trace_dump(int fd);
+
+#endif
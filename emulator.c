@@ -0,0 +1,612 @@
+/*****************************************************************
+/
+/ File   :   emulator.c
+/ Date   :   October 16, 2026
+/ Purpose:   Behavioral model of the CR-75 firmware with an ISO 7816-3
+/            T=0 or T=1 card behind it.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "emulator.h"
+#include "atr.h"
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* 3B 14 96 "CR75": T=0 only, Fi = 512, Di = 32 */
+static const uint8_t default_atr[] = { 0x3B, 0x14, 0x96, 'C', 'R', '7', '5' };
+
+void emulator_config_from_env(struct emulator_config *config) {
+    memset(config, 0, sizeof(*config));
+    memcpy(config->atr, default_atr, sizeof(default_atr));
+    config->atr_length = sizeof(default_atr);
+    config->present = 1;
+
+    const char *value = getenv("CR75_EMULATOR_ATR");
+    if(value) {
+        size_t length = 0;
+        unsigned int byte;
+        int consumed;
+        while(length < EMULATOR_MAX_ATR && sscanf(value, " %2x%n", &byte, &consumed) == 1) {
+            config->atr[length++] = byte;
+            value += consumed;
+        }
+        config->atr_length = length;
+    }
+    if((value = getenv("CR75_EMULATOR_CARD"))) {
+        config->present = atoi(value) != 0;
+    }
+    if((value = getenv("CR75_EMULATOR_CLOCK"))) {
+        config->clock = atoi(value);
+    }
+    if((value = getenv("CR75_EMULATOR_NULLS"))) {
+        config->nulls = atoi(value);
+    }
+    if((value = getenv("CR75_EMULATOR_BYTEWISE"))) {
+        config->bytewise = atoi(value) != 0;
+    }
+    if((value = getenv("CR75_EMULATOR_PPS_REJECT"))) {
+        config->pps_reject = atoi(value) != 0;
+    }
+}
+
+/* Built-in application: SELECT answers with an FCI, READ/UPDATE BINARY
+   work on one transparent file, GET DATA always returns 8 bytes whatever
+   Le says and GET CHALLENGE returns Le pseudo random bytes. */
+static unsigned int builtin_apdu(void *context, const uint8_t *header, const uint8_t *data, size_t lc, unsigned int ne, uint8_t *response, size_t *length) {
+    struct emulator *emulator = context;
+    unsigned int offset = ((header[2] << 8) | header[3]) & 0x7FFF;
+    static uint32_t seed = 0x12345678;
+    unsigned int i;
+
+    *length = 0;
+    if(!data && lc) {
+        // T=0 header of a command with data
+        return (header[1] == 0xD6 && offset + lc > EMULATOR_FILE_SIZE) ? 0x6B00 : 0x9000;
+    }
+    switch(header[1]) {
+        case 0xA4: {
+            static const uint8_t fci[] = { 0x6F, 0x12, 0x84, 0x10, 'C', 'R', '-', '7', '5', ' ', 'E', 'M', 'U', 'L', 'A', 'T', 'O', 'R', 0x00, 0x01 };
+            memcpy(response, fci, sizeof(fci));
+            *length = sizeof(fci);
+            return 0x9000;
+        }
+        case 0xB0:
+            if(offset + ne > EMULATOR_FILE_SIZE) {
+                return 0x6B00;
+            }
+            memcpy(response, &emulator->file[offset], ne);
+            *length = ne;
+            return 0x9000;
+        case 0xD6:
+            if(offset + lc > EMULATOR_FILE_SIZE) {
+                return 0x6B00;
+            }
+            memcpy(&emulator->file[offset], data, lc);
+            return 0x9000;
+        case 0xCA:
+            for(i = 0; i < 8; i++) {
+                response[i] = 0xC0 + i;
+            }
+            *length = 8;
+            return 0x9000;
+        case 0x84:
+            for(i = 0; i < ne; i++) {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                response[i] = seed & 0xFF;
+            }
+            *length = ne;
+            return 0x9000;
+        case 0xC0:
+            // Nothing left for GET RESPONSE
+            return 0x6985;
+        case 0xC2:
+            return 0x9000;
+        default:
+            return 0x6D00;
+    }
+}
+
+/* Commands whose P3 is Lc rather than Le */
+static int incoming(uint8_t ins) {
+    static const uint8_t instructions[] = { 0x20, 0x22, 0x24, 0x2A, 0x82, 0x86, 0x88, 0xA4, 0xC2, 0xD0, 0xD6, 0xDA, 0xDC, 0xE0, 0xE2 };
+    return memchr(instructions, ins, sizeof(instructions)) != NULL;
+}
+
+int emulator_init(struct emulator *emulator, const struct emulator_config *config) {
+    memset(emulator, 0, sizeof(*emulator));
+    emulator->config = *config;
+    if(!emulator->config.apdu) {
+        emulator->config.apdu = builtin_apdu;
+        emulator->config.context = emulator;
+    }
+    emulator->response = malloc(EMULATOR_MAX_RESPONSE);
+    emulator->file = calloc(1, EMULATOR_FILE_SIZE);
+    emulator->apdu = malloc(EMULATOR_MAX_APDU);
+    if(!emulator->response || !emulator->file || !emulator->apdu) {
+        emulator_free(emulator);
+        return -1;
+    }
+    emulator->fidi = 0x11;
+    emulator->card_fidi = 0x11;
+    emulator->present = config->present;
+    emulator->state = CARD_OFF;
+    return 0;
+}
+
+void emulator_free(struct emulator *emulator) {
+    free(emulator->response);
+    free(emulator->file);
+    free(emulator->apdu);
+    emulator->response = NULL;
+    emulator->file = NULL;
+    emulator->apdu = NULL;
+}
+
+/* Takes as long as the card needs for count characters of 12 ETU */
+static void card_delay(struct emulator *emulator, size_t count) {
+    if(!emulator->config.clock || !count) {
+        return;
+    }
+    uint64_t ns = (uint64_t) count * 12 * atr_fi(emulator->fidi) * 1000000ULL / ((uint64_t) atr_di(emulator->fidi) * emulator->config.clock);
+    struct timespec delay = { ns / 1000000000ULL, ns % 1000000000ULL };
+    nanosleep(&delay, NULL);
+}
+
+static void card_send(struct emulator *emulator, const uint8_t *bytes, size_t count) {
+    size_t i;
+    for(i = 0; i < count && emulator->queue_length < EMULATOR_QUEUE_SIZE; i++) {
+        emulator->queue[(emulator->queue_head + emulator->queue_length++) % EMULATOR_QUEUE_SIZE] = bytes[i];
+    }
+}
+
+/* Sends the configured NULL bytes, then a procedure byte or SW1 */
+static void card_procedure(struct emulator *emulator, uint8_t byte) {
+    static const uint8_t null = 0x60;
+    unsigned int i;
+    for(i = 0; i < emulator->config.nulls; i++) {
+        card_send(emulator, &null, 1);
+    }
+    card_send(emulator, &byte, 1);
+}
+
+/* Response data after an ACK, or byte by byte after INS complements */
+static void card_send_data(struct emulator *emulator, uint8_t ins, const uint8_t *data, size_t length) {
+    size_t i;
+    if(!emulator->config.bytewise) {
+        card_procedure(emulator, ins);
+        card_send(emulator, data, length);
+        return;
+    }
+    for(i = 0; i < length; i++) {
+        card_procedure(emulator, ~ins);
+        card_send(emulator, &data[i], 1);
+    }
+}
+
+static void card_status(struct emulator *emulator, unsigned int sw) {
+    uint8_t sw2 = sw & 0xFF;
+    card_procedure(emulator, sw >> 8);
+    card_send(emulator, &sw2, 1);
+}
+
+static void card_get_response(struct emulator *emulator, unsigned int ne) {
+    size_t available = emulator->response_length - emulator->response_offset;
+    if(ne > available) {
+        card_status(emulator, 0x6C00 | (available & 0xFF));
+    } else {
+        card_send_data(emulator, 0xC0, &emulator->response[emulator->response_offset], ne);
+        emulator->response_offset += ne;
+        available -= ne;
+        card_status(emulator, available ? 0x6100 | (available > 255 ? 0 : available) : 0x9000);
+    }
+}
+
+static void card_execute(struct emulator *emulator, size_t lc, unsigned int ne, int outgoing) {
+    const uint8_t *header = emulator->command;
+    size_t length = 0;
+    unsigned int sw = emulator->config.apdu(emulator->config.context, header, &header[5], lc, ne, emulator->response, &length);
+    if(length > EMULATOR_MAX_RESPONSE) {
+        length = EMULATOR_MAX_RESPONSE;
+    }
+    emulator->response_length = 0;
+    emulator->response_offset = 0;
+
+    if(length == 0) {
+        card_status(emulator, sw);
+    } else if(!outgoing) {
+        // Case 4: the data waits for GET RESPONSE
+        emulator->response_length = length;
+        card_status(emulator, (sw == 0x9000) ? 0x6100 | (length > 255 ? 0 : length) : sw);
+    } else if(length != ne) {
+        card_status(emulator, 0x6C00 | (length & 0xFF));
+    } else {
+        card_send_data(emulator, header[1], emulator->response, length);
+        card_status(emulator, sw);
+    }
+}
+
+static void card_header(struct emulator *emulator) {
+    uint8_t ins = emulator->command[1];
+    uint8_t p3 = emulator->command[4];
+    unsigned int ne = p3 ? p3 : 256;
+
+    emulator->state = CARD_HEADER;
+    emulator->command_length = 0;
+    if(ins == 0xC0 && emulator->response_offset < emulator->response_length) {
+        card_get_response(emulator, ne);
+    } else if(incoming(ins) && p3) {
+        size_t length = 0;
+        unsigned int sw = emulator->config.apdu(emulator->config.context, emulator->command, NULL, p3, 0, emulator->response, &length);
+        if(sw != 0x9000) {
+            // Refused on the header, what follows is the next header
+            card_status(emulator, sw);
+            return;
+        }
+        emulator->state = CARD_DATA;
+        emulator->command_length = 5;
+        emulator->data_expected = p3;
+        card_procedure(emulator, emulator->config.bytewise ? ~ins : ins);
+    } else {
+        card_execute(emulator, 0, incoming(ins) ? 0 : ne, !incoming(ins));
+    }
+}
+
+#define T1_R_BLOCK 0x80
+#define T1_S_BLOCK 0xC0
+#define T1_S_RESPONSE 0x20
+
+/* Appends LRC or CRC to block and returns the new length */
+static size_t block_edc(const struct emulator *emulator, uint8_t *block, size_t length) {
+    size_t i;
+    if(emulator->crc) {
+        uint16_t crc = 0xFFFF;
+        int bit;
+        for(i = 0; i < length; i++) {
+            crc ^= block[i];
+            for(bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+            }
+        }
+        block[length] = crc >> 8;
+        block[length + 1] = crc & 0xFF;
+        return length + 2;
+    }
+    uint8_t lrc = 0;
+    for(i = 0; i < length; i++) {
+        lrc ^= block[i];
+    }
+    block[length] = lrc;
+    return length + 1;
+}
+
+static void card_block(struct emulator *emulator, uint8_t pcb, const uint8_t *inf, size_t length) {
+    uint8_t *block = emulator->last_block;
+    block[0] = 0;
+    block[1] = pcb;
+    block[2] = length;
+    if(length) {
+        memcpy(&block[3], inf, length);
+    }
+    emulator->last_block_length = block_edc(emulator, block, 3 + length);
+    card_send(emulator, block, emulator->last_block_length);
+}
+
+static void card_r_block(struct emulator *emulator, int error) {
+    card_block(emulator, T1_R_BLOCK | (emulator->nr << 4) | error, NULL, 0);
+}
+
+/* Next I-block of the response, chained while it exceeds IFSD */
+static void card_response_block(struct emulator *emulator) {
+    size_t remaining = emulator->response_length - emulator->response_sent;
+    size_t chunk = (remaining > emulator->ifsd) ? emulator->ifsd : remaining;
+    uint8_t pcb = (emulator->ns << 6) | ((chunk < remaining) ? 0x20 : 0);
+    card_block(emulator, pcb, &emulator->response[emulator->response_sent], chunk);
+    emulator->response_sent += chunk;
+    emulator->ns ^= 1;
+}
+
+/* Splits the APDU as ISO 7816-4 5.1 does and runs it through the application */
+static void card_execute_apdu(struct emulator *emulator) {
+    const uint8_t *apdu = emulator->apdu;
+    size_t length = emulator->apdu_length;
+    uint8_t header[5] = { 0 };
+    size_t lc = 0;
+    unsigned int ne = 0;
+    unsigned int sw = 0x6700;
+    size_t response_length = 0;
+
+    memcpy(header, apdu, (length < 4) ? length : 4);
+    if(length == 5) {
+        ne = apdu[4] ? apdu[4] : 256;
+    } else if(length > 5 && apdu[4]) {
+        lc = apdu[4];
+        if(length == 6 + lc) {
+            ne = apdu[5 + lc] ? apdu[5 + lc] : 256;
+        } else if(length != 5 + lc) {
+            length = 0;
+        }
+    } else if(length == 7) {
+        ne = (apdu[5] << 8) | apdu[6];
+        ne = ne ? ne : 65536;
+    } else if(length > 7) {
+        lc = (apdu[5] << 8) | apdu[6];
+        if(length == 9 + lc) {
+            ne = (apdu[7 + lc] << 8) | apdu[8 + lc];
+            ne = ne ? ne : 65536;
+        } else if(length != 7 + lc) {
+            length = 0;
+        }
+    }
+    if(ne > EMULATOR_MAX_RESPONSE - 2) {
+        ne = EMULATOR_MAX_RESPONSE - 2;
+    }
+
+    if(length >= 4) {
+        header[4] = lc ? lc : ne;
+        const uint8_t *data = &apdu[(lc && apdu[4] == 0) ? 7 : 5];
+        sw = emulator->config.apdu(emulator->config.context, header, data, lc, ne, emulator->response, &response_length);
+        if(response_length > EMULATOR_MAX_RESPONSE - 2) {
+            response_length = EMULATOR_MAX_RESPONSE - 2;
+        }
+    }
+    emulator->response[response_length] = sw >> 8;
+    emulator->response[response_length + 1] = sw & 0xFF;
+    emulator->response_length = response_length + 2;
+    emulator->response_sent = 0;
+    card_response_block(emulator);
+}
+
+/* A complete block from the reader */
+static void card_t1(struct emulator *emulator) {
+    uint8_t *block = emulator->block;
+    uint8_t pcb = block[1];
+    size_t length = block[2];
+    uint8_t edc[EMULATOR_MAX_BLOCK];
+    memcpy(edc, block, 3 + length);
+    size_t edc_length = block_edc(emulator, edc, 3 + length) - 3 - length;
+    if(memcmp(&edc[3 + length], &block[3 + length], edc_length)) {
+        card_r_block(emulator, 1);
+        return;
+    }
+
+    if(!(pcb & 0x80)) {
+        if(((pcb >> 6) & 1) != emulator->nr) {
+            card_r_block(emulator, 2);
+            return;
+        }
+        emulator->nr ^= 1;
+        if(emulator->apdu_length + length > EMULATOR_MAX_APDU) {
+            emulator->apdu_length = 0;
+        }
+        memcpy(&emulator->apdu[emulator->apdu_length], &block[3], length);
+        emulator->apdu_length += length;
+        if(pcb & 0x20) {
+            card_r_block(emulator, 0);
+            return;
+        }
+        card_execute_apdu(emulator);
+        emulator->apdu_length = 0;
+    } else if((pcb & 0xC0) == T1_R_BLOCK) {
+        // N(R) naming the card's next block acknowledges the last one
+        if(((pcb >> 4) & 1) == emulator->ns && emulator->response_sent < emulator->response_length) {
+            card_response_block(emulator);
+        } else {
+            card_send(emulator, emulator->last_block, emulator->last_block_length);
+        }
+    } else if(!(pcb & T1_S_RESPONSE)) {
+        switch(pcb & 0x1F) {
+            case 0x00:
+                emulator->ns = 0;
+                emulator->nr = 0;
+                emulator->ifsd = 32;
+                emulator->apdu_length = 0;
+                break;
+            case 0x01:
+                if(length == 1 && block[3] >= 1 && block[3] <= 254) {
+                    emulator->ifsd = block[3];
+                }
+                break;
+            case 0x02:
+                emulator->apdu_length = 0;
+                emulator->response_length = 0;
+                break;
+        }
+        card_block(emulator, pcb | T1_S_RESPONSE, &block[3], length);
+    }
+}
+
+/* One byte from the reader to the card */
+static void card_receive(struct emulator *emulator, uint8_t byte) {
+    switch(emulator->state) {
+        case CARD_OFF:
+            break;
+        case CARD_IDLE:
+            if(byte == 0xFF) {
+                emulator->state = CARD_PPS;
+                emulator->pps[0] = byte;
+                emulator->pps_length = 1;
+                break;
+            }
+            if(emulator->protocol == 1) {
+                emulator->state = CARD_BLOCK;
+                emulator->block_length = 0;
+                card_receive(emulator, byte);
+                break;
+            }
+            emulator->state = CARD_HEADER;
+            // fall through
+        case CARD_HEADER:
+            emulator->command[emulator->command_length++] = byte;
+            if(emulator->command_length == 5) {
+                card_header(emulator);
+            }
+            break;
+        case CARD_PPS: {
+            emulator->pps[emulator->pps_length++] = byte;
+            uint8_t pps0 = emulator->pps[1];
+            size_t expected = 3 + !!(pps0 & 0x10) + !!(pps0 & 0x20) + !!(pps0 & 0x40);
+            if(emulator->pps_length == expected) {
+                if(emulator->config.pps_reject && (pps0 & 0x10)) {
+                    // Keeps the default rate by leaving out PPS1
+                    uint8_t response[] = { 0xFF, pps0 & 0x0F, 0 };
+                    response[2] = response[0] ^ response[1];
+                    card_send(emulator, response, sizeof(response));
+                } else {
+                    // Accepts everything by echoing the request
+                    card_send(emulator, emulator->pps, expected);
+                    if(pps0 & 0x10) {
+                        emulator->card_fidi = emulator->pps[2];
+                    }
+                }
+                emulator->protocol = pps0 & 0x0F;
+                emulator->state = (emulator->protocol == 1) ? CARD_BLOCK : CARD_HEADER;
+                emulator->command_length = 0;
+                emulator->block_length = 0;
+            }
+            break;
+        }
+        case CARD_BLOCK:
+            emulator->block[emulator->block_length++] = byte;
+            if(emulator->block_length >= 3 && emulator->block_length == 3 + (size_t) emulator->block[2] + (emulator->crc ? 2 : 1)) {
+                card_t1(emulator);
+                emulator->block_length = 0;
+            } else if(emulator->block_length == EMULATOR_MAX_BLOCK) {
+                emulator->block_length = 0;
+            }
+            break;
+        case CARD_DATA:
+            emulator->command[emulator->command_length++] = byte;
+            if(emulator->command_length == 5 + emulator->data_expected) {
+                emulator->state = CARD_HEADER;
+                emulator->command_length = 0;
+                card_execute(emulator, emulator->data_expected, 0, 0);
+            } else if(emulator->config.bytewise) {
+                card_procedure(emulator, ~emulator->command[1]);
+            }
+            break;
+    }
+}
+
+static void card_reset(struct emulator *emulator) {
+    struct atr atr;
+    emulator->queue_head = 0;
+    emulator->queue_length = 0;
+    emulator->response_length = 0;
+    emulator->response_offset = 0;
+    emulator->command_length = 0;
+    emulator->fidi = 0x11;
+    emulator->card_fidi = 0x11;
+    emulator->protocol = 0;
+    emulator->crc = 0;
+    if(!atr_parse(emulator->config.atr, emulator->config.atr_length, &atr)) {
+        emulator->protocol = (atr.protocol == 1) ? 1 : 0;
+        emulator->crc = atr.crc;
+        // TA2: the card switches to TA1 right after the ATR
+        if(atr.specific_mode && !atr.implicit) {
+            emulator->card_fidi = atr.fidi;
+        }
+    }
+    emulator->block_length = 0;
+    emulator->ns = 0;
+    emulator->nr = 0;
+    emulator->ifsd = 32;
+    emulator->apdu_length = 0;
+    emulator->state = CARD_IDLE;
+    card_send(emulator, emulator->config.atr, emulator->config.atr_length);
+}
+
+int emulator_control(struct emulator *emulator, uint8_t type, uint8_t request, uint16_t index, unsigned char *data, uint16_t length) {
+    switch(request) {
+        case 161:
+            // ATR length in the first byte, the ATR follows on bulk IN
+            if(!(type & LIBUSB_ENDPOINT_IN) || !length) {
+                return LIBUSB_ERROR_PIPE;
+            }
+            memset(data, 0, length);
+            if(emulator->present) {
+                card_reset(emulator);
+                data[0] = emulator->config.atr_length;
+                emulator->in_expected = emulator->config.atr_length;
+            }
+            return length;
+        case 165:
+            if(length < 2) {
+                return LIBUSB_ERROR_PIPE;
+            }
+            emulator->fidi = data[1];
+            return length;
+        case 192:
+            emulator->out_expected = index;
+            return 0;
+        case 193:
+            emulator->in_expected = index;
+            return 0;
+        default:
+            return LIBUSB_ERROR_PIPE;
+    }
+}
+
+int emulator_bulk(struct emulator *emulator, unsigned char endpoint, unsigned char *data, int length, int *transferred) {
+    *transferred = 0;
+    if(endpoint == 0x05) {
+        int i;
+        card_delay(emulator, length);
+        // A card at another rate than the reader only sees garbage
+        for(i = 0; i < length && emulator->fidi == emulator->card_fidi; i++) {
+            card_receive(emulator, data[i]);
+        }
+        *transferred = length;
+        emulator->out_expected -= (emulator->out_expected < (unsigned int) length) ? emulator->out_expected : (unsigned int) length;
+        return 0;
+    }
+    if(endpoint != 0x86) {
+        return LIBUSB_ERROR_PIPE;
+    }
+
+    // The firmware passes on what the card sent, a card that stays silent
+    // makes the transfer time out
+    size_t count = emulator->queue_length;
+    if(count > (size_t) length) {
+        count = length;
+    }
+    if(count > emulator->in_expected) {
+        count = emulator->in_expected;
+    }
+    if(!count) {
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    card_delay(emulator, count);
+    size_t i;
+    for(i = 0; i < count; i++) {
+        data[i] = emulator->queue[emulator->queue_head];
+        emulator->queue_head = (emulator->queue_head + 1) % EMULATOR_QUEUE_SIZE;
+    }
+    emulator->queue_length -= count;
+    emulator->in_expected -= count;
+    *transferred = count;
+    return 0;
+}
+
+void emulator_insert(struct emulator *emulator, int present) {
+    emulator->present = present;
+    emulator->presence_changed = 1;
+    if(!present) {
+        emulator->state = CARD_OFF;
+        emulator->queue_length = 0;
+    }
+}
+
+int emulator_interrupt(struct emulator *emulator, uint8_t *status) {
+    if(!emulator->presence_changed) {
+        return 0;
+    }
+    emulator->presence_changed = 0;
+    *status = emulator->present ? 0x01 : 0x00;
+    return 1;
+}
@@ -0,0 +1,118 @@
+/*****************************************************************
+/
+/ File   :   emulator.h
+/ Date   :   October 16, 2026
+/ Purpose:   Behavioral model of the CR-75 firmware with an ISO 7816-3
+/            T=0 or T=1 card behind it.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _emulator_h_
+#define _emulator_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EMULATOR_PACKET_SIZE 64 /* wMaxPacketSize of bulk IN 0x86 */
+#define EMULATOR_MAX_ATR 33
+#define EMULATOR_MAX_RESPONSE 65536
+#define EMULATOR_FILE_SIZE 32768 /* transparent file behind READ/UPDATE BINARY */
+#define EMULATOR_QUEUE_SIZE 4096 /* bytes the card sent that were not read yet */
+#define EMULATOR_MAX_APDU (7 + 65535 + 3) /* extended case 4 */
+#define EMULATOR_MAX_BLOCK (3 + 254 + 2) /* T=1 prologue, INF and CRC */
+
+/* The card's application: handles one TPDU (one APDU for T=1, with P3
+   holding the low byte of Lc or Le) with lc bytes of command data
+   and puts up to ne response bytes (256 if P3 asked for 0) into response.
+   Returns SW1 SW2. A response of a different length than ne makes the card
+   answer 6Cxx to case 2 commands and 61xx to case 3/4 ones, as cards do.
+   For T=0 it is first called with data NULL when the header of a command
+   with data arrives. Any status but 90 00 is then sent instead of the ACK
+   and the data never taken. */
+typedef unsigned int (*emulator_apdu)(void *context, const uint8_t *header, const uint8_t *data, size_t lc, unsigned int ne, uint8_t *response, size_t *length);
+
+struct emulator_config {
+    uint8_t atr[EMULATOR_MAX_ATR];
+    size_t atr_length;
+    int present;            /* card inserted at start */
+    unsigned int clock;     /* card clock in kHz to pace bytes at, 0 for no delay */
+    unsigned int nulls;     /* NULL (60) procedure bytes before every procedure byte */
+    int bytewise;           /* INS complement instead of ACK, one data byte at a time */
+    int pps_reject;         /* answer PPS without PPS1, keeping the default rate */
+    emulator_apdu apdu;     /* NULL for the built-in application */
+    void *context;
+};
+
+enum emulator_card_state {
+    CARD_OFF,
+    CARD_IDLE,      /* reset, the next byte starts a PPS or a header */
+    CARD_PPS,
+    CARD_HEADER,
+    CARD_DATA,      /* receiving command data after an ACK */
+    CARD_BLOCK      /* T=1, receiving a block */
+};
+
+struct emulator {
+    struct emulator_config config;
+
+    /* Firmware */
+    uint8_t fidi;
+    unsigned int out_expected;  /* announced by request 192 */
+    unsigned int in_expected;   /* announced by request 193 */
+    int present;
+    int presence_changed;       /* pending 0x84 interrupt */
+
+    /* Card */
+    enum emulator_card_state state;
+    int protocol;               /* T=0 or T=1, from TD1 of the ATR or PPS0 */
+    int crc;                    /* T=1 EDC, from the ATR */
+    uint8_t card_fidi;          /* rate the card runs at, bytes sent at another one are lost */
+    uint8_t command[5 + 255];   /* header and command data */
+    size_t command_length;
+    size_t data_expected;
+    uint8_t pps[6];
+    size_t pps_length;
+    uint8_t *response;          /* EMULATOR_MAX_RESPONSE bytes for GET RESPONSE */
+    size_t response_length;
+    size_t response_offset;
+    uint8_t *file;              /* EMULATOR_FILE_SIZE bytes */
+
+    /* T=1 */
+    uint8_t block[EMULATOR_MAX_BLOCK];
+    size_t block_length;
+    uint8_t last_block[EMULATOR_MAX_BLOCK]; /* sent again when the reader asks */
+    size_t last_block_length;
+    uint8_t ns;                 /* N(S) of the card's next I-block */
+    uint8_t nr;                 /* N(S) expected from the reader */
+    size_t ifsd;
+    uint8_t *apdu;              /* EMULATOR_MAX_APDU bytes, chained command */
+    size_t apdu_length;
+    size_t response_sent;       /* chained response bytes sent so far */
+
+    /* Bytes sent by the card, read through bulk IN */
+    uint8_t queue[EMULATOR_QUEUE_SIZE];
+    size_t queue_head;
+    size_t queue_length;
+};
+
+/* Reads CR75_EMULATOR_ATR, CR75_EMULATOR_CARD, CR75_EMULATOR_CLOCK,
+   CR75_EMULATOR_NULLS, CR75_EMULATOR_BYTEWISE and CR75_EMULATOR_PPS_REJECT
+   on top of the defaults */
+void emulator_config_from_env(struct emulator_config *config);
+
+int emulator_init(struct emulator *emulator, const struct emulator_config *config);
+void emulator_free(struct emulator *emulator);
+
+/* Same arguments and results as libusb_control_transfer (with wValue
+   0xffff) and libusb_bulk_transfer on the CR-75 */
+int emulator_control(struct emulator *emulator, uint8_t type, uint8_t request, uint16_t index, unsigned char *data, uint16_t length);
+int emulator_bulk(struct emulator *emulator, unsigned char endpoint, unsigned char *data, int length, int *transferred);
+
+/* Inserts or removes the card, raising an 0x84 interrupt */
+void emulator_insert(struct emulator *emulator, int present);
+
+/* Returns 1 and the byte sent on 0x84 if an interrupt is pending */
+int emulator_interrupt(struct emulator *emulator, uint8_t *status);
+
+#endif
@@ -0,0 +1,188 @@
+/*****************************************************************
+/
+/ File   :   emulator_transport.c
+/ Date   :   October 16, 2026
+/ Purpose:   Transport to the in-process CR-75 emulator.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "reader.h"
+#include "emulator.h"
+#include <syslog.h>
+#include <stdlib.h>
+
+struct emulated {
+    struct emulator emulator;
+    pthread_mutex_t lock; /* transfers and wait() run on different threads */
+    pthread_cond_t wake;
+    int interrupted;
+    /* Bulk IN of arm_in(). It completes with request 193, when the reader
+       has the response, and bulk() hands out the result. */
+    unsigned char *armed;
+    int armed_length;
+    int armed_err;
+    int armed_transferred;
+    int armed_completed;
+};
+
+static RESPONSECODE emulated_open(struct reader *reader, const struct device_match *match) {
+    struct emulated *emulated = calloc(1, sizeof(*emulated));
+    struct emulator_config config;
+    emulator_config_from_env(&config);
+    if(!emulated || emulator_init(&emulated->emulator, &config)) {
+        free(emulated);
+        return IFD_COMMUNICATION_ERROR;
+    }
+    pthread_mutex_init(&emulated->lock, NULL);
+    pthread_cond_init(&emulated->wake, NULL);
+    reader->transport_data = emulated;
+
+    reader->in_packet_size = EMULATOR_PACKET_SIZE;
+    ATOMIC_STORE(reader->card_present, config.present ? IFD_ICC_PRESENT : IFD_ICC_NOT_PRESENT);
+    ATOMIC_STORE(reader->monitoring, 1);
+    syslog(LOG_INFO, "Opened emulated reader");
+    return IFD_SUCCESS;
+}
+
+static void emulated_close(struct reader *reader) {
+    struct emulated *emulated = reader->transport_data;
+    if(!emulated) {
+        return;
+    }
+    emulator_free(&emulated->emulator);
+    pthread_cond_destroy(&emulated->wake);
+    pthread_mutex_destroy(&emulated->lock);
+    free(emulated);
+    reader->transport_data = NULL;
+}
+
+/* Delivers a pending 0x84 interrupt, as libusb does while handling events
+   for any transfer. Called with emulated->lock held. */
+static int deliver_interrupt(struct reader *reader, struct emulated *emulated) {
+    uint8_t status;
+    if(!emulator_interrupt(&emulated->emulator, &status)) {
+        return 0;
+    }
+    set_card_present(reader, status);
+    return 1;
+}
+
+/* The model answers at once or not at all, so timeouts don't apply */
+static int emulated_control(struct reader *reader, uint8_t type, uint8_t request, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout) {
+    struct emulated *emulated = reader->transport_data;
+    pthread_mutex_lock(&emulated->lock);
+    deliver_interrupt(reader, emulated);
+    int err = emulator_control(&emulated->emulator, type, request, index, data, length);
+    if(request == 193 && err >= 0 && emulated->armed && !emulated->armed_completed) {
+        emulated->armed_err = emulator_bulk(&emulated->emulator, 0x86, emulated->armed, emulated->armed_length, &emulated->armed_transferred);
+        emulated->armed_completed = 1;
+    }
+    pthread_mutex_unlock(&emulated->lock);
+    return err;
+}
+
+static int emulated_bulk(struct reader *reader, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+    struct emulated *emulated = reader->transport_data;
+    pthread_mutex_lock(&emulated->lock);
+    deliver_interrupt(reader, emulated);
+    int err;
+    if(endpoint == 0x86 && emulated->armed == data && emulated->armed_length == length) {
+        if(!emulated->armed_completed) {
+            emulated->armed_err = emulator_bulk(&emulated->emulator, endpoint, data, length, &emulated->armed_transferred);
+        }
+        err = emulated->armed_err;
+        *transferred = emulated->armed_transferred;
+        emulated->armed = NULL;
+    } else {
+        err = emulator_bulk(&emulated->emulator, endpoint, data, length, transferred);
+    }
+    pthread_mutex_unlock(&emulated->lock);
+    return err;
+}
+
+/* The chunks go to the card one after the other, in the order they would
+   complete on USB */
+static RESPONSECODE emulated_write_async(struct reader *reader, PUCHAR msg, size_t length, unsigned int timeout) {
+    struct emulated *emulated = reader->transport_data;
+    size_t offset;
+    int err = 0;
+    pthread_mutex_lock(&emulated->lock);
+    deliver_interrupt(reader, emulated);
+    for(offset = 0; offset < length && err >= 0; offset += BUFFER_SIZE) {
+        int chunk = (length - offset < BUFFER_SIZE) ? length - offset : BUFFER_SIZE;
+        int transferred;
+        trace_add(&reader->trace, TRACE_OUT, 0x05, &msg[offset], chunk);
+        err = emulator_bulk(&emulated->emulator, 0x05, &msg[offset], chunk, &transferred);
+        METRICS_INC(reader, bulk_transfers);
+        METRICS_ADD(reader, bytes_out, transferred);
+    }
+    pthread_mutex_unlock(&emulated->lock);
+    CHECK_LIBUSB(err);
+    return IFD_SUCCESS;
+}
+
+/* Only records the read, the emulator answers as soon as it is asked */
+static int emulated_arm_in(struct reader *reader, unsigned char *data, int length, unsigned int timeout) {
+    struct emulated *emulated = reader->transport_data;
+    pthread_mutex_lock(&emulated->lock);
+    emulated->armed = data;
+    emulated->armed_length = length;
+    emulated->armed_transferred = 0;
+    emulated->armed_completed = 0;
+    pthread_mutex_unlock(&emulated->lock);
+    return 0;
+}
+
+static int emulated_wait(struct reader *reader, int timeout, int *completed) {
+    struct emulated *emulated = reader->transport_data;
+    pthread_mutex_lock(&emulated->lock);
+    if(!deliver_interrupt(reader, emulated) && !(completed && ATOMIC_LOAD(*completed)) && !emulated->interrupted) {
+        transport_sleep(&emulated->wake, &emulated->lock, timeout);
+        deliver_interrupt(reader, emulated);
+    }
+    emulated->interrupted = 0;
+    pthread_mutex_unlock(&emulated->lock);
+    return 0;
+}
+
+static void emulated_interrupt(struct reader *reader) {
+    struct emulated *emulated = reader->transport_data;
+    pthread_mutex_lock(&emulated->lock);
+    emulated->interrupted = 1;
+    pthread_cond_broadcast(&emulated->wake);
+    pthread_mutex_unlock(&emulated->lock);
+}
+
+/* TAG_CR75_EMULATOR_CARD, inserts or removes the emulated card */
+RESPONSECODE emulator_transport_insert(struct reader *reader, int present) {
+    if(reader->transport != &emulator_transport) {
+        return IFD_ERROR_VALUE_READ_ONLY;
+    }
+    struct emulated *emulated = reader->transport_data;
+    pthread_mutex_lock(&emulated->lock);
+    emulator_insert(&emulated->emulator, present);
+    pthread_cond_broadcast(&emulated->wake);
+    pthread_mutex_unlock(&emulated->lock);
+    return IFD_SUCCESS;
+}
+
+/* The emulator behind reader, so tests can swap the card's application */
+struct emulator *emulator_transport_emulator(struct reader *reader) {
+    if(reader->transport != &emulator_transport) {
+        return NULL;
+    }
+    return &((struct emulated *) reader->transport_data)->emulator;
+}
+
+const struct transport emulator_transport = {
+    "emulator",
+    emulated_open,
+    emulated_close,
+    emulated_control,
+    emulated_bulk,
+    emulated_write_async,
+    emulated_arm_in,
+    emulated_wait,
+    emulated_interrupt
+};
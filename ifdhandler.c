@@ -8,96 +8,185 @@
 /
 ******************************************************************/
 
-#include "ifdhandler.h"
+#include "reader.h"
+#include "cr75.h"
+#include "timeline.h"
 #include <syslog.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <ctype.h>
-#include <libusb.h>
-
-#define VENDOR_ID 0x1307
-#define PRODUCT_ID 0x0361
-#define INTERFACE 1
-#define TIMEOUT 5000 /* timeout in ms */
-#define BUFFER_SIZE 16
-
-#define CHECK(x) do { \
-    RESPONSECODE retval = (x); \
-    if (retval != 0) { \
-        return retval; \
-    } \
-} while (0)
-#define CHECK_LIBUSB(x) do { \
-    int retval = (x); \
-    if (retval < 0) { \
-        return libusb_error_to_responsecode(retval); \
-    } \
-} while (0)
-
-#ifdef __APPLE__
-#define PRIdword "u"
+#include <time.h>
+
+#define DEFAULT_FIDI 0x11 /* Fd = 372, Dd = 1 */
+
+#define CARD_CLOCK 3580 /* kHz, the clock the CR-75 is assumed to give the card */
+#define CONTROL_TIMEOUT 2000 /* ms for vendor requests, answered by the firmware */
+#define TIMEOUT_MARGIN 100 /* ms added to the card's time for USB and firmware latency */
+
+#ifdef DEBUG
+#define TRACE_DEFAULT 1
 #else
-#define PRIdword "lu"
+#define TRACE_DEFAULT 0
 #endif
 
-libusb_context *ctx = NULL;
-libusb_device_handle *handle = NULL;
-struct libusb_transfer *transfer = NULL;
+/* Readers are indexed by the XXXX part of the 0xXXXXYYYY Lun */
+struct reader readers[MAX_READERS];
+pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER; /* guards opening and closing */
 
-RESPONSECODE card_present = IFD_ICC_NOT_PRESENT;
-UCHAR cached_Atr[MAX_ATR_SIZE];
-DWORD cached_AtrLength = 0;
+struct reader *get_reader(DWORD Lun) {
+    DWORD index = Lun >> 16;
+    if(index >= MAX_READERS || !readers[index].in_use) {
+        syslog(LOG_ERR, "No channel open for Lun %"PRIdword, Lun);
+        return NULL;
+    }
+    return &readers[index];
+}
 
-void log_command(const char *prefix, const PUCHAR in, DWORD length) {
-#ifdef DEBUG
-        // 2 + 1 characters + 1 space for every byte
-        // 3 characters for brackets + NULL
-        char out[4 * length + 3];
-        strcpy(out, "");
+RESPONSECODE libusb_error_to_responsecode(const int err) {
+    switch(err) {
+        case LIBUSB_ERROR_TIMEOUT:
+            return IFD_RESPONSE_TIMEOUT;
+        case LIBUSB_ERROR_NO_DEVICE:
+            return IFD_NO_SUCH_DEVICE;
+        case LIBUSB_ERROR_PIPE:
+        case LIBUSB_ERROR_OVERFLOW:
+        default:
+            return IFD_COMMUNICATION_ERROR;
+    }
+}
 
-        DWORD i;
-        for(i=0; i<length; i++) {
-            sprintf(&out[3*i], "%02X ", in[i]);
-        }
+/* Records a presence change reported by the reader. Transports call it from
+   libusb callbacks, possibly while another thread holds reader->lock, so it
+   only touches atomics; card_lost tells the others about the removal. */
+void set_card_present(struct reader *reader, int present) {
+    if(!present) {
+        __atomic_fetch_add(&reader->removals, 1, __ATOMIC_ACQ_REL);
+    }
+    ATOMIC_STORE(reader->card_removed, !present);
+    ATOMIC_STORE(reader->card_present, present ? IFD_ICC_PRESENT : IFD_ICC_NOT_PRESENT);
+    ATOMIC_STORE(reader->presence_changed, 1);
+}
 
-        strcat(out, "[");
-        for(i=0; i<length; i++) {
-            if(isprint(in[i])) {
-                strncat(out, (char*) &in[i], 1);
-            } else {
-                strcat(out, ".");
+/* The card cached_Atr was read from has been removed since. This holds
+   after another card is inserted, until that one is powered up. */
+int card_lost(struct reader *reader) {
+    return ATOMIC_LOAD(reader->removals) != reader->atr_removals;
+}
+
+/* Parses the DeviceName pcscd passes to IFDHCreateChannelByName. Parts that
+   are not understood are ignored, as required by the IFD handler API. */
+void parse_device_name(const char *DeviceName, struct device_match *match) {
+    match->bus = -1;
+    match->address = -1;
+    match->port_count = 0;
+
+    int bus, address;
+    const char *p;
+    if((p = strstr(DeviceName, ":libusb-1.0:"))) {
+        // usb:1307/0361:libusb-1.0:<bus>:<address>:<interface>
+        if(sscanf(p, ":libusb-1.0:%d:%d", &bus, &address) == 2) {
+            match->bus = bus;
+            match->address = address;
+        }
+    } else if((p = strstr(DeviceName, ":libudev:"))) {
+        // usb:1307/0361:libudev:<interface>:/dev/bus/usb/<bus>/<address>
+        p = strstr(p, "/dev/bus/usb/");
+        if(p && sscanf(p, "/dev/bus/usb/%d/%d", &bus, &address) == 2) {
+            match->bus = bus;
+            match->address = address;
+        }
+    } else if((p = strstr(DeviceName, ":port:"))) {
+        // usb:1307/0361:port:<bus>-<port>.<port>..., as in /sys/bus/usb/devices
+        int consumed;
+        p += strlen(":port:");
+        if(sscanf(p, "%d-%n", &bus, &consumed) == 1) {
+            match->bus = bus;
+            p += consumed;
+            int port;
+            while(match->port_count < MAX_PORT_DEPTH && sscanf(p, "%d%n", &port, &consumed) == 1) {
+                match->ports[match->port_count++] = port;
+                p += consumed;
+                if(*p != '.') {
+                    break;
+                }
+                p++;
             }
         }
-        strcat(out, "]");
+    }
+}
 
-        syslog(LOG_DEBUG, "%s %s", prefix, out);
-#endif
+void close_reader(struct reader *reader) {
+    if(reader->transport) {
+        reader->transport->close(reader);
+    }
+    pthread_mutex_destroy(&reader->lock);
+    memset(reader, 0, sizeof(*reader));
 }
 
-int submit_transfer(struct libusb_transfer *transfer) {
-    int err = libusb_submit_transfer(transfer);
-    switch(err) {
-        case 0:
-            break;
-        case LIBUSB_ERROR_NO_DEVICE:
-            syslog(LOG_ERR, "Device not connected");
-            break;
-        default:
-            syslog(LOG_ERR, "Error %i while monitoring card status", err);
+/* CR75_EMULATOR, CR75_REPLAY and CR75_RECORD replace or wrap the libusb
+   transport */
+const struct transport *select_transport(void) {
+#ifdef WITH_EMULATOR
+    const char *emulator = getenv("CR75_EMULATOR");
+    if(emulator && atoi(emulator)) {
+        return &emulator_transport;
     }
-    return err;
+#endif
+    if(getenv("CR75_REPLAY")) {
+        return &replay_transport;
+    }
+    if(getenv("CR75_RECORD")) {
+        return &record_transport;
+    }
+    return &usb_transport;
 }
 
-static void LIBUSB_CALL MonitorCardPresence(struct libusb_transfer *transfer) {
-    if(transfer->buffer[0] == 0x01) {
-        syslog(LOG_INFO, "Card detected");
-        card_present = IFD_ICC_PRESENT;
+RESPONSECODE create_channel(DWORD Lun, const struct device_match *match) {
+    DWORD index = Lun >> 16;
+    if(index >= MAX_READERS) {
+        syslog(LOG_ERR, "Lun %"PRIdword" exceeds the %i supported readers", Lun, MAX_READERS);
+        return IFD_COMMUNICATION_ERROR;
+    }
+    pthread_mutex_lock(&readers_lock);
+    struct reader *reader = &readers[index];
+    if(reader->in_use) {
+        pthread_mutex_unlock(&readers_lock);
+        syslog(LOG_ERR, "Channel for Lun %"PRIdword" already open", Lun);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    memset(reader, 0, sizeof(*reader));
+    pthread_mutex_init(&reader->lock, NULL);
+    reader->async_depth = ASYNC_DEPTH;
+    const char *depth = getenv("CR75_ASYNC_DEPTH");
+    if(depth) {
+        reader->async_depth = (atoi(depth) > 0) ? atoi(depth) : 0;
+    }
+    reader->card_clock = CARD_CLOCK;
+    const char *clock = getenv("CR75_CARD_CLOCK");
+    if(clock && atoi(clock) > 0) {
+        reader->card_clock = atoi(clock);
+    }
+    reader->control_timeout = CONTROL_TIMEOUT;
+    const char *timeout = getenv("CR75_CONTROL_TIMEOUT");
+    if(timeout && atoi(timeout) > 0) {
+        reader->control_timeout = atoi(timeout);
+    }
+    reader->card_present = IFD_ICC_NOT_PRESENT;
+    reader->t0_get_response = 1;
+    const char *combined = getenv("CR75_T0_COMBINED");
+    reader->t0_combined = combined && atoi(combined) != 0;
+    const char *trace = getenv("CR75_TRACE");
+    reader->trace.enabled = trace ? atoi(trace) != 0 : TRACE_DEFAULT;
+    reader->transport = select_transport();
+    RESPONSECODE rv = reader->transport->open(reader, match);
+    if(rv != IFD_SUCCESS) {
+        close_reader(reader);
     } else {
-        syslog(LOG_INFO, "Card not present");
-        card_present = IFD_ICC_NOT_PRESENT;
+        reader->in_use = 1;
     }
-    submit_transfer(transfer);
+    pthread_mutex_unlock(&readers_lock);
+    return rv;
 }
 
 
@@ -136,34 +225,40 @@ RESPONSECODE IFDHCreateChannel ( DWORD Lun, DWORD Channel ) {
      IFD_COMMUNICATION_ERROR
   */
     syslog(LOG_DEBUG, "IFDHCreateChannel");
-    int err = libusb_init(&ctx);
-    if(err) {
-        syslog(LOG_ERR, "Error %i while initializing device", err);
-        return IFD_COMMUNICATION_ERROR;
-    }
+    timeline_init();
+    uint64_t start = timeline_begin();
+    struct device_match match;
+    parse_device_name("", &match);
+    RESPONSECODE rv = create_channel(Lun, &match);
+    timeline_end("IFDHCreateChannel", Lun >> 16, start, "rv", rv);
 
-    handle = libusb_open_device_with_vid_pid(ctx, VENDOR_ID, PRODUCT_ID);
-    if(!handle) {
-        syslog(LOG_ERR, "Unable to obtain handle");
-        return IFD_COMMUNICATION_ERROR;
-    }
+    syslog(LOG_DEBUG, "IFDHCreateChannel completed");
+    return rv;
+}
 
-    err = libusb_claim_interface(handle, INTERFACE);
-    if(err) {
-        syslog(LOG_ERR, "Error %i while claiming interface", err);
-        return IFD_COMMUNICATION_ERROR;
-    }
+RESPONSECODE IFDHCreateChannelByName ( DWORD Lun, LPSTR DeviceName ) {
+  /* Same as IFDHCreateChannel, but binds Lun to the reader described by
+     DeviceName, e.g. usb:1307/0361:libusb-1.0:<bus>:<address>:<interface>,
+     usb:1307/0361:libudev:<interface>:/dev/bus/usb/<bus>/<address> or
+     usb:1307/0361:port:<bus>-<port>.<port>. Several CR-75s on one host
+     can be served by a single driver instance this way.
 
-    unsigned char *buffer = malloc(1 * sizeof(unsigned char));
-    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-    if (!transfer)
-        return IFD_COMMUNICATION_ERROR;
-    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
-    libusb_fill_interrupt_transfer(transfer, handle, 0x84, buffer, 1, MonitorCardPresence, NULL, 0);
-    submit_transfer(transfer);
+     returns:
 
-    syslog(LOG_DEBUG, "IFDHCreateChannel completed");
-    return IFD_SUCCESS;
+     IFD_SUCCESS
+     IFD_COMMUNICATION_ERROR
+     IFD_NO_SUCH_DEVICE
+  */
+    syslog(LOG_DEBUG, "IFDHCreateChannelByName: %s", DeviceName);
+    timeline_init();
+    uint64_t start = timeline_begin();
+    struct device_match match;
+    parse_device_name(DeviceName, &match);
+    RESPONSECODE rv = create_channel(Lun, &match);
+    timeline_end("IFDHCreateChannelByName", Lun >> 16, start, "rv", rv);
+
+    syslog(LOG_DEBUG, "IFDHCreateChannelByName completed");
+    return rv;
 }
 
 RESPONSECODE IFDHCloseChannel ( DWORD Lun ) {
@@ -179,13 +274,70 @@ RESPONSECODE IFDHCloseChannel ( DWORD Lun ) {
      IFD_COMMUNICATION_ERROR     
   */
     syslog(LOG_DEBUG, "IFDHCloseChannel");
-    libusb_cancel_transfer(transfer);
-    libusb_handle_events_completed(ctx, NULL);
-    libusb_free_transfer(transfer);
+    struct reader *reader = get_reader(Lun);
+    if(!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    uint64_t start = timeline_begin();
+    pthread_mutex_lock(&readers_lock);
+    close_reader(reader);
+    pthread_mutex_unlock(&readers_lock);
+    timeline_end("IFDHCloseChannel", Lun >> 16, start, NULL, 0);
+    timeline_flush();
+    return IFD_SUCCESS;
+}
 
-    libusb_release_interface(handle, INTERFACE);
-    libusb_close(handle);
-    libusb_exit(ctx);
+/* Polling thread callback for TAG_IFD_POLLING_THREAD_WITH_TIMEOUT. Blocks in
+   libusb until the 0x84 interrupt transfer reports an insertion or removal,
+   IFDHStopPolling() is called or timeout (in ms) expires. pcscd calls
+   IFDHICCPresence() after every return. */
+static RESPONSECODE IFDHPolling(DWORD Lun, int timeout) {
+    struct reader *reader = get_reader(Lun);
+    if(!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    uint64_t start = timeline_begin();
+    RESPONSECODE rv = IFD_SUCCESS;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+
+    while(!ATOMIC_LOAD(reader->presence_changed) && !ATOMIC_LOAD(reader->stop_polling)) {
+        if(!ATOMIC_LOAD(reader->monitoring)) {
+            rv = IFD_NO_SUCH_DEVICE;
+            break;
+        }
+
+        long remaining = -1;
+        if(timeout >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining = (deadline.tv_sec - now.tv_sec) * 1000L + (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+            if(remaining <= 0) {
+                break;
+            }
+        }
+
+        int err = reader->transport->wait(reader, remaining, &reader->presence_changed);
+        if(err < 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+            rv = libusb_error_to_responsecode(err);
+            break;
+        }
+    }
+    timeline_end("IFDHPolling", Lun >> 16, start, "timeout", timeout);
+    return rv;
+}
+
+/* Callback for TAG_IFD_STOP_POLLING_THREAD, wakes up IFDHPolling() */
+static RESPONSECODE IFDHStopPolling(DWORD Lun) {
+    struct reader *reader = get_reader(Lun);
+    if(!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    ATOMIC_STORE(reader->stop_polling, 1);
+    reader->transport->interrupt(reader);
     return IFD_SUCCESS;
 }
 
@@ -209,15 +361,31 @@ RESPONSECODE IFDHGetCapabilities ( DWORD Lun, DWORD Tag,
      IFD_ERROR_TAG
   */
   syslog(LOG_DEBUG, "IFDHGetCapabilities");
+  uint64_t start = timeline_begin();
+  RESPONSECODE rv = IFD_SUCCESS;
   switch(Tag) {
         case TAG_IFD_ATR: {
-            *Length = cached_AtrLength;
-            memcpy(Value, cached_Atr, cached_AtrLength);
+            struct reader *reader = get_reader(Lun);
+            if(!reader) {
+                rv = IFD_COMMUNICATION_ERROR;
+                break;
+            }
+            pthread_mutex_lock(&reader->lock);
+            *Length = card_lost(reader) ? 0 : reader->cached_AtrLength;
+            memcpy(Value, reader->cached_Atr, *Length);
+            pthread_mutex_unlock(&reader->lock);
             break;
         }
         case TAG_IFD_SIMULTANEOUS_ACCESS: {
             *Length = 1;
-            *Value = 0;
+            *Value = MAX_READERS;
+            break;
+        }
+        case TAG_IFD_THREAD_SAFE:
+        case TAG_IFD_SLOT_THREAD_SAFE: {
+            // Every reader has its own lock, pcscd may call us concurrently
+            *Length = 1;
+            *Value = 1;
             break;
         }
         case TAG_IFD_SLOTS_NUMBER: {
@@ -225,10 +393,64 @@ RESPONSECODE IFDHGetCapabilities ( DWORD Lun, DWORD Tag,
             *Value = 1;
             break;
         }
+        case TAG_IFD_POLLING_THREAD_WITH_TIMEOUT: {
+            *Length = sizeof(void *);
+            if(Value) {
+                *(RESPONSECODE (**)(DWORD, int)) Value = IFDHPolling;
+            }
+            break;
+        }
+        case TAG_IFD_POLLING_THREAD_KILLABLE: {
+            *Length = 1;
+            *Value = 1;
+            break;
+        }
+        case TAG_IFD_STOP_POLLING_THREAD: {
+            *Length = sizeof(void *);
+            if(Value) {
+                *(RESPONSECODE (**)(DWORD)) Value = IFDHStopPolling;
+            }
+            break;
+        }
+        case TAG_CR75_METRICS: {
+            struct reader *reader = get_reader(Lun);
+            if(!reader) {
+                rv = IFD_COMMUNICATION_ERROR;
+                break;
+            }
+            struct cr75_metrics metrics;
+            metrics_snapshot(reader, &metrics);
+            if(*Length > sizeof(metrics)) {
+                *Length = sizeof(metrics);
+            }
+            memcpy(Value, &metrics, *Length);
+            break;
+        }
+        case TAG_CR75_T0_ENVELOPE:
+        case TAG_CR75_T0_GET_RESPONSE:
+        case TAG_CR75_T0_COMBINED:
+        case TAG_CR75_TRACE: {
+            struct reader *reader = get_reader(Lun);
+            if(!reader) {
+                rv = IFD_COMMUNICATION_ERROR;
+                break;
+            }
+            *Length = 1;
+            if(Tag == TAG_CR75_TRACE) {
+                *Value = ATOMIC_LOAD(reader->trace.enabled);
+            } else if(Tag == TAG_CR75_T0_COMBINED) {
+                *Value = reader->t0_combined;
+            } else {
+                *Value = (Tag == TAG_CR75_T0_ENVELOPE) ? reader->t0_envelope : reader->t0_get_response;
+            }
+            break;
+        }
         default:
-            return IFD_ERROR_TAG;
+            rv = IFD_ERROR_TAG;
+            break;
     }
-    return IFD_SUCCESS;
+    timeline_end("IFDHGetCapabilities", Lun >> 16, start, "tag", Tag);
+    return rv;
 }
 
 RESPONSECODE IFDHSetCapabilities ( DWORD Lun, DWORD Tag, 
@@ -251,10 +473,56 @@ RESPONSECODE IFDHSetCapabilities ( DWORD Lun, DWORD Tag,
      IFD_ERROR_VALUE_READ_ONLY
   */
   syslog(LOG_DEBUG, "IFDHSetCapabilities");
-  return IFD_NOT_SUPPORTED;
+    struct reader *reader = get_reader(Lun);
+    if(!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    uint64_t start = timeline_begin();
+    RESPONSECODE rv = IFD_SUCCESS;
+
+    switch(Tag) {
+        case TAG_CR75_T0_ENVELOPE:
+        case TAG_CR75_T0_GET_RESPONSE:
+        case TAG_CR75_T0_COMBINED:
+        case TAG_CR75_TRACE: {
+            if(Length != 1 || *Value > 1) {
+                rv = IFD_ERROR_SET_FAILURE;
+                break;
+            }
+            pthread_mutex_lock(&reader->lock);
+            if(Tag == TAG_CR75_T0_ENVELOPE) {
+                reader->t0_envelope = *Value;
+            } else if(Tag == TAG_CR75_T0_COMBINED) {
+                reader->t0_combined = *Value;
+            } else if(Tag == TAG_CR75_TRACE) {
+                ATOMIC_STORE(reader->trace.enabled, *Value);
+            } else {
+                reader->t0_get_response = *Value;
+            }
+            pthread_mutex_unlock(&reader->lock);
+            break;
+        }
+#ifdef WITH_EMULATOR
+        case TAG_CR75_EMULATOR_CARD: {
+            if(Length != 1) {
+                rv = IFD_ERROR_SET_FAILURE;
+                break;
+            }
+            rv = emulator_transport_insert(reader, *Value);
+            break;
+        }
+#endif
+        default:
+            rv = IFD_ERROR_TAG;
+            break;
+    }
+    timeline_end("IFDHSetCapabilities", Lun >> 16, start, "tag", Tag);
+    return rv;
   
 }
 
+RESPONSECODE reset_and_negotiate(struct reader *reader, int protocol, UCHAR fidi);
+
 RESPONSECODE IFDHSetProtocolParameters ( DWORD Lun, DWORD Protocol, 
 				   UCHAR Flags, UCHAR PTS1,
 				   UCHAR PTS2, UCHAR PTS3) {
@@ -276,54 +544,495 @@ RESPONSECODE IFDHSetProtocolParameters ( DWORD Lun, DWORD Protocol,
      IFD_PROTOCOL_NOT_SUPPORTED
   */
   syslog(LOG_DEBUG, "IFDHSetProtocolParameters: Protocol %"PRIdword", Flags %i, PTS1 %i, PTS2 %i, PTS3 %i", Protocol, Flags, PTS1, PTS2, PTS3);
-  return IFD_SUCCESS;
+    struct reader *reader = get_reader(Lun);
+    if(!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    int protocol;
+    switch(Protocol) {
+        case SCARD_PROTOCOL_T0:
+            protocol = 0;
+            break;
+        case SCARD_PROTOCOL_T1:
+            protocol = 1;
+            break;
+        default:
+            return IFD_PROTOCOL_NOT_SUPPORTED;
+    }
+
+    uint64_t start = timeline_begin();
+    pthread_mutex_lock(&reader->lock);
+    RESPONSECODE rv = IFD_SUCCESS;
+    UCHAR fidi = (Flags & IFD_NEGOTIATE_PTS1) ? PTS1 : 0;
+    if(protocol != reader->protocol || (fidi && fidi != reader->fidi)) {
+        // Only one PPS exchange is allowed per reset. Without PTS1 the
+        // fastest rate from TA1 is negotiated, as IFDHPowerICC does.
+        rv = reset_and_negotiate(reader, protocol, fidi);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    timeline_end("IFDHSetProtocolParameters", Lun >> 16, start, "protocol", protocol);
+    return rv;
 
 }
 
-RESPONSECODE libusb_error_to_responsecode(const int err) {
-    switch(err) {
-        case LIBUSB_ERROR_TIMEOUT:
-            return IFD_RESPONSE_TIMEOUT;
-        case LIBUSB_ERROR_NO_DEVICE:
-            return IFD_NO_SUCH_DEVICE;
-        case LIBUSB_ERROR_PIPE:
-        case LIBUSB_ERROR_OVERFLOW:
-        default:
-            return IFD_COMMUNICATION_ERROR;
+/* Traces a vendor request as endpoint 0 with request, wIndex and data */
+static void trace_control(struct reader *reader, uint8_t direction, uint8_t request, uint16_t index, const unsigned char *data, int length) {
+    if(!ATOMIC_LOAD(reader->trace.enabled)) {
+        return;
+    }
+    UCHAR record[3 + TRACE_DATA];
+    int kept = (length < TRACE_DATA - 3) ? length : TRACE_DATA - 3;
+    record[0] = request;
+    record[1] = index >> 8;
+    record[2] = index & 0xFF;
+    if(kept > 0) {
+        memcpy(&record[3], data, kept);
     }
+    trace_add(&reader->trace, direction, 0, record, 3 + ((length > 0) ? length : 0));
 }
 
-RESPONSECODE writeMessage(PUCHAR msg, size_t length) {
-    log_command(">", msg, length);
+/* Longest the card may take for a bulk transfer of length bytes, in ms.
+   It may wait WWT (T=0) or BWT (T=1, stretched by a pending WTX) before
+   answering and then needs 12 ETU plus guard time per byte. Before an ATR
+   is known, ISO 7816-3's initial waiting time of 9600 ETU at Fi/Di 372/1
+   applies. A T=0 NULL restarts WWT, which a new transfer does anyway. */
+unsigned int bulk_timeout(struct reader *reader, unsigned char endpoint, int length) {
+    int known = reader->cached_AtrLength > 0;
+    uint64_t fi = known ? atr_fi(reader->fidi) : 372;
+    uint64_t di = known ? atr_di(reader->fidi) : 1;
+    uint64_t clock = reader->card_clock;
+    uint64_t wait_us = 0;
+    if(endpoint & LIBUSB_ENDPOINT_IN) {
+        if(!known) {
+            wait_us = (uint64_t) 9600 * 372 * 1000 / clock;
+        } else if(reader->protocol == 1) {
+            unsigned int bwi = (reader->atr.bwi <= 9) ? reader->atr.bwi : 9;
+            wait_us = (11 * fi * 1000) / (di * clock) + ((uint64_t) 1 << bwi) * 960 * 372 * 1000 / clock;
+            if(reader->t1.wtx > 1) {
+                wait_us *= reader->t1.wtx;
+            }
+        } else {
+            uint64_t wi = reader->atr.wi ? reader->atr.wi : 10;
+            wait_us = 960 * wi * fi * 1000 / clock;
+        }
+    }
+    uint64_t etus = (uint64_t) length * (12 + (known && reader->atr.n < 255 ? reader->atr.n : 0));
+    uint64_t bytes_us = etus * fi * 1000 / (di * clock);
+    return (wait_us + bytes_us + 999) / 1000 + TIMEOUT_MARGIN;
+}
 
-    CHECK_LIBUSB(libusb_control_transfer(handle, 0x40, 192, 0xffff, length, 0, 0, TIMEOUT));
+/* Vendor request through the reader's transport, counted in the metrics */
+int control_transfer(struct reader *reader, uint8_t type, uint8_t request, uint16_t index, unsigned char *data, uint16_t length) {
+    METRICS_INC(reader, control_transfers);
+    if(!(type & LIBUSB_ENDPOINT_IN)) {
+        trace_control(reader, TRACE_OUT, request, index, data, length);
+    }
+    uint64_t start = timeline_begin();
+    int err = reader->transport->control(reader, type, request, index, data, length, reader->control_timeout);
+    timeline_end("control", reader - readers, start, "request", request);
+    if(err < 0) {
+        metrics_usb_error(reader, err);
+    } else if(type & LIBUSB_ENDPOINT_IN) {
+        trace_control(reader, TRACE_IN, request, index, data, err);
+    }
+    return err;
+}
 
-    int transferred;
-    DWORD i;
-    for(i = 0; i < length; i+= BUFFER_SIZE) {
-        DWORD bytes_remaining = length - i;
-        DWORD msg_length = (bytes_remaining < BUFFER_SIZE) ? bytes_remaining : BUFFER_SIZE;
-        CHECK_LIBUSB(libusb_bulk_transfer(handle, 0x05, &msg[i], msg_length, &transferred, TIMEOUT));
+/* Bulk transfer through the reader's transport, counted in the metrics */
+int bulk_transfer(struct reader *reader, unsigned char endpoint, unsigned char *data, int length, int *transferred) {
+    METRICS_INC(reader, bulk_transfers);
+    if(!(endpoint & LIBUSB_ENDPOINT_IN)) {
+        trace_add(&reader->trace, TRACE_OUT, endpoint, data, length);
     }
-    return IFD_SUCCESS;
+    uint64_t start = timeline_begin();
+    int err = reader->transport->bulk(reader, endpoint, data, length, transferred, bulk_timeout(reader, endpoint, length));
+    timeline_end((endpoint & LIBUSB_ENDPOINT_IN) ? "bulk IN" : "bulk OUT", reader - readers, start, "length", length);
+    if(err < 0) {
+        metrics_usb_error(reader, err);
+    } else if(endpoint & LIBUSB_ENDPOINT_IN) {
+        trace_add(&reader->trace, TRACE_IN, endpoint, data, *transferred);
+        METRICS_ADD(reader, bytes_in, *transferred);
+    } else {
+        METRICS_ADD(reader, bytes_out, *transferred);
+    }
+    return err;
+}
+
+/* Bulk IN length that readResponse asks for first */
+int response_request_length(struct reader *reader, int expected_length) {
+    return ((expected_length + reader->in_packet_size - 1) / reader->in_packet_size) * reader->in_packet_size;
+}
+
+void disarm_response(struct reader *reader) {
+    if(reader->armed_length) {
+        reader->transport->arm_in(reader, NULL, 0, 0);
+        reader->armed_length = 0;
+    }
+}
+
+/* Submits the first bulk IN of a response of expected_length bytes, see
+   writeCommand. Returns whether it is pending. */
+int arm_response(struct reader *reader, int expected_length, unsigned int timeout) {
+    int length = response_request_length(reader, expected_length);
+    if(!reader->async_depth || !reader->transport->arm_in || length > ARMED_SIZE) {
+        return 0;
+    }
+    if(reader->transport->arm_in(reader, reader->armed, length, timeout) < 0) {
+        return 0;
+    }
+    reader->armed_length = length;
+    reader->armed_expected = expected_length;
+    return 1;
+}
+
+/* writeMessage for a command that the next readResponse picks up the
+   response_length byte answer to. The bulk IN for it is submitted right
+   after request 192, so it is pending while the command goes out and
+   completes as soon as the reader has the response, instead of only being
+   submitted after request 193. */
+RESPONSECODE writeCommand(struct reader *reader, PUCHAR msg, size_t length, int response_length) {
+    uint64_t start = timeline_begin();
+    disarm_response(reader);
+    CHECK_LIBUSB(control_transfer(reader, 0x40, 192, length, 0, 0));
+    if(response_length > 0) {
+        unsigned int timeout = bulk_timeout(reader, 0x05, length) + bulk_timeout(reader, 0x86, response_length);
+        arm_response(reader, response_length, timeout);
+    }
+
+    RESPONSECODE rv = IFD_SUCCESS;
+    if(reader->async_depth > 1 && length > BUFFER_SIZE && reader->transport->write_async) {
+        rv = reader->transport->write_async(reader, msg, length, bulk_timeout(reader, 0x05, BUFFER_SIZE));
+    } else {
+        int transferred;
+        DWORD i;
+        for(i = 0; i < length && rv == IFD_SUCCESS; i+= BUFFER_SIZE) {
+            DWORD bytes_remaining = length - i;
+            DWORD msg_length = (bytes_remaining < BUFFER_SIZE) ? bytes_remaining : BUFFER_SIZE;
+            int err = bulk_transfer(reader, 0x05, &msg[i], msg_length, &transferred);
+            if(err < 0) {
+                rv = libusb_error_to_responsecode(err);
+            }
+        }
+    }
+    if(rv != IFD_SUCCESS) {
+        disarm_response(reader);
+    }
+    timeline_end("writeMessage", reader - readers, start, "length", length);
+    return rv;
+}
+
+RESPONSECODE writeMessage(struct reader *reader, PUCHAR msg, size_t length) {
+    return writeCommand(reader, msg, length, 0);
 }
 
-RESPONSECODE readMessage(int expected_length, PUCHAR msg) {
-    CHECK_LIBUSB(libusb_control_transfer(handle, 0x40, 193, 0xffff, expected_length, 0, 0, TIMEOUT));
+/* Reads up to expected_length bytes. The reader ends a response early with
+   a zero-length packet when the card has nothing more to send, *received
+   tells how much arrived. */
+RESPONSECODE readResponse(struct reader *reader, int expected_length, PUCHAR msg, DWORD capacity, PDWORD received) {
+    *received = 0;
+    if(expected_length < 0 || (DWORD) expected_length > capacity) {
+        syslog(LOG_ERR, "Response of %i bytes does not fit in buffer of %"PRIdword" bytes", expected_length, capacity);
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+    }
+
+    uint64_t start = timeline_begin();
+    int armed = 0;
+    if(reader->armed_length && reader->armed_expected == expected_length) {
+        armed = reader->armed_length;
+    } else {
+        disarm_response(reader);
+    }
+    int err = control_transfer(reader, 0x40, 193, expected_length, 0, 0);
+    if(err < 0) {
+        disarm_response(reader);
+        return libusb_error_to_responsecode(err);
+    }
+    reader->armed_length = 0;
 
     int transferred;
     int total_transferred = 0;
-    UCHAR buffer[BUFFER_SIZE];
     while(total_transferred < expected_length) {
-        CHECK_LIBUSB(libusb_bulk_transfer(handle, 0x86, buffer, sizeof(buffer), &transferred, TIMEOUT));
-        memcpy(&msg[total_transferred], buffer, transferred);
+        if(armed) {
+            // Submitted by writeCommand, into a buffer of its own as the
+            // caller's may be smaller than whole packets
+            CHECK_LIBUSB(bulk_transfer(reader, 0x86, reader->armed, armed, &transferred));
+            if((DWORD) transferred > capacity) {
+                syslog(LOG_ERR, "Response of %i bytes does not fit in buffer of %"PRIdword" bytes", transferred, capacity);
+                return IFD_ERROR_INSUFFICIENT_BUFFER;
+            }
+            memcpy(msg, reader->armed, transferred);
+            armed = 0;
+        } else {
+            // Ask for whole packets so the response arrives in as few transfers
+            // as possible, but never for more than the caller's buffer can hold.
+            int bytes_remaining = expected_length - total_transferred;
+            int request_length = response_request_length(reader, bytes_remaining);
+            if((DWORD) request_length > capacity - total_transferred) {
+                request_length = capacity - total_transferred;
+            }
+            CHECK_LIBUSB(bulk_transfer(reader, 0x86, &msg[total_transferred], request_length, &transferred));
+        }
         total_transferred += transferred;
+        *received = total_transferred;
+        if(transferred == 0) {
+            break;
+        }
+    }
+    timeline_end("readMessage", reader - readers, start, "length", total_transferred);
+    return IFD_SUCCESS;
+}
+
+RESPONSECODE readMessage(struct reader *reader, int expected_length, PUCHAR msg, DWORD capacity) {
+    DWORD received;
+    CHECK(readResponse(reader, expected_length, msg, capacity, &received));
+    if(received < (DWORD) expected_length) {
+        syslog(LOG_ERR, "Response ended after %"PRIdword" of %i bytes", received, expected_length);
+        return IFD_COMMUNICATION_ERROR;
+    }
+    return IFD_SUCCESS;
+}
+
+
+/* Fi/Di values request 165 is known to program the reader's UART with.
+   There is no documentation of the firmware, so this is only what the
+   driver has run cards at: 11 after every reset and 13 (F = 372, D = 4),
+   which the driver used to request from every card. */
+int reader_supports_fidi(UCHAR fidi) {
+    return fidi == DEFAULT_FIDI || fidi == 0x13;
+}
+
+/* Picks the fastest Fi/Di that both the card (as announced in TA1) and the
+   reader support, i.e. the one with the fewest clock cycles per ETU. */
+UCHAR select_fidi(UCHAR ta1) {
+    UCHAR best = DEFAULT_FIDI;
+    UCHAR fi_indexes[] = { ta1 >> 4, DEFAULT_FIDI >> 4 };
+    int i, d;
+    for(i = 0; i < 2; i++) {
+        UCHAR fi = fi_indexes[i] << 4;
+        if(!atr_fi(fi) || atr_fi(fi) > atr_fi(ta1)) {
+            continue;
+        }
+        for(d = 1; d <= 9; d++) {
+            UCHAR fidi = fi | d;
+            if(atr_di(fidi) > atr_di(ta1) || !reader_supports_fidi(fidi)) {
+                continue;
+            }
+            if(atr_fi(fidi) * atr_di(best) < atr_fi(best) * atr_di(fidi)) {
+                best = fidi;
+            }
+        }
+    }
+    return best;
+}
+
+/* Requests the ATR with vendor request 161, which also (re)sets the card,
+   and decodes it into reader->atr */
+RESPONSECODE fetch_atr(struct reader *reader) {
+    unsigned char buffer[BUFFER_SIZE];
+    unsigned int removals = ATOMIC_LOAD(reader->removals);
+    reader->cached_AtrLength = 0;
+    CHECK_LIBUSB(control_transfer(reader, 0xc0, 161, 0xffff, buffer, sizeof(buffer)));
+
+    DWORD length = buffer[0];
+    if(length < 2 || length > MAX_ATR_SIZE) {
+        syslog(LOG_ERR, "Invalid ATR length %"PRIdword, length);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    // ATRs of up to 33 bytes may need several packets
+    UCHAR atr[MAX_ATR_SIZE];
+    DWORD received = 0;
+    while(received < length) {
+        int transferred;
+        CHECK_LIBUSB(bulk_transfer(reader, 0x86, &atr[received], length - received, &transferred));
+        if(!transferred) {
+            syslog(LOG_ERR, "ATR ended after %"PRIdword" of %"PRIdword" bytes", received, length);
+            return IFD_COMMUNICATION_ERROR;
+        }
+        received += transferred;
+    }
+
+    if(atr_parse(atr, length, &reader->atr)) {
+        syslog(LOG_ERR, "ATR has invalid structure or TCK");
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    reader->cached_AtrLength = length;
+    memcpy(reader->cached_Atr, atr, reader->cached_AtrLength);
+    // A removal while the ATR was read leaves the card lost
+    reader->atr_removals = removals;
+    reader->fidi = DEFAULT_FIDI;
+    memset(reader->t0_acked, 0, sizeof(reader->t0_acked));
+    // The first protocol offered in TD1 is the one the card runs without PPS
+    reader->protocol = (reader->atr.protocol == 1) ? 1 : 0;
+    return IFD_SUCCESS;
+}
+
+/* Programs the reader's clock divider for the given Fi/Di */
+RESPONSECODE set_reader_fidi(struct reader *reader, UCHAR fidi) {
+    unsigned char parameters[] = { 0x00, fidi };
+    CHECK_LIBUSB(control_transfer(reader, 0x40, 165, 0xffff, parameters, sizeof(parameters)));
+    reader->fidi = fidi;
+    return IFD_SUCCESS;
+}
+
+/* Sends PPSS PPS0 PPS1 PCK and checks that the card echoes it */
+RESPONSECODE pps_exchange(struct reader *reader, int protocol, UCHAR fidi) {
+    UCHAR command[] = { 0xFF, 0x10 | protocol, fidi, 0x00 };
+    command[3] = command[0] ^ command[1] ^ command[2];
+    CHECK(writeCommand(reader, command, sizeof(command), 2));
+
+    // A card that refuses PPS1 answers with a shorter PPS0 PCK response,
+    // so read PPSS PPS0 first to learn how many bytes follow.
+    UCHAR msg[6];
+    CHECK(readMessage(reader, 2, msg, sizeof(msg)));
+    if(msg[0] != 0xFF) {
+        syslog(LOG_ERR, "Read invalid");
+        return IFD_ERROR_PTS_FAILURE;
     }
+    int remaining = 1 + !!(msg[1] & 0x10) + !!(msg[1] & 0x20) + !!(msg[1] & 0x40);
+    CHECK(readMessage(reader, remaining, &msg[2], sizeof(msg) - 2));
 
-    log_command("<", msg, total_transferred);
+    UCHAR pck = 0;
+    int i;
+    for(i = 0; i < 2 + remaining; i++) {
+        pck ^= msg[i];
+    }
+    if(pck != 0 || memcmp(command, msg, sizeof(command))) {
+        syslog(LOG_INFO, "Card did not accept Fi/Di %02X", fidi);
+        return IFD_ERROR_PTS_FAILURE;
+    }
     return IFD_SUCCESS;
 }
 
+/* Negotiates fidi (or the fastest rate from TA1 when 0) with a freshly reset
+   card. If the card rejects it, it is reset again and kept at the default
+   rate, as ISO 7816-3 doesn't allow a second PPS exchange. */
+RESPONSECODE negotiate(struct reader *reader, int protocol, UCHAR fidi) {
+    UCHAR requested = fidi;
+    if(protocol < 0) {
+        protocol = reader->protocol;
+    }
+
+    if(reader->atr.specific_mode) {
+        // TA2: the card already runs at its final protocol and rate, PPS is
+        // not allowed. The reader follows it even if a request is refused.
+        fidi = reader->atr.implicit ? DEFAULT_FIDI : reader->atr.fidi;
+        if(!reader_supports_fidi(fidi)) {
+            syslog(LOG_ERR, "Card in specific mode at unsupported Fi/Di %02X", fidi);
+            return IFD_ERROR_PTS_FAILURE;
+        }
+        CHECK(set_reader_fidi(reader, fidi));
+        if(protocol != reader->protocol) {
+            syslog(LOG_ERR, "Card in specific mode runs T=%i only", reader->protocol);
+            return IFD_PROTOCOL_NOT_SUPPORTED;
+        }
+        return (requested && requested != fidi) ? IFD_ERROR_PTS_FAILURE : IFD_SUCCESS;
+    }
+    if(protocol > 1 || !(reader->atr.protocols & ATR_PROTOCOL(protocol))) {
+        syslog(LOG_ERR, "Card does not offer T=%i", protocol);
+        return IFD_PROTOCOL_NOT_SUPPORTED;
+    }
+    if(!requested) {
+        // Without TA1 the card only promises Fd/Dd, which it runs at already
+        fidi = reader->atr.has_ta1 ? select_fidi(reader->atr.fidi) : DEFAULT_FIDI;
+    }
+
+    if(fidi != DEFAULT_FIDI || protocol != reader->protocol) {
+        uint64_t start = metrics_now();
+        METRICS_INC(reader, pps_exchanges);
+        RESPONSECODE rv = pps_exchange(reader, protocol, fidi);
+        metrics_time(reader->metrics.pps_time, start);
+        if(rv != IFD_SUCCESS) {
+            METRICS_INC(reader, pps_failures);
+        }
+        if(rv == IFD_SUCCESS) {
+            reader->protocol = protocol;
+            syslog(LOG_INFO, "Negotiated T=%i, F = %u, D = %u", reader->protocol, atr_fi(fidi), atr_di(fidi));
+            return set_reader_fidi(reader, fidi);
+        }
+        if(rv == IFD_NO_SUCH_DEVICE) {
+            return rv;
+        }
+        CHECK(fetch_atr(reader));
+    }
+
+    CHECK(set_reader_fidi(reader, DEFAULT_FIDI));
+    if((requested && requested != DEFAULT_FIDI) || protocol != reader->protocol) {
+        return IFD_ERROR_PTS_FAILURE;
+    }
+    return IFD_SUCCESS;
+}
+
+/* Negotiates protocol and fidi after the ATR as negotiate() does. A T=1
+   card is then told ifsd, unless that is the default of 32 it starts with. */
+RESPONSECODE start_protocol(struct reader *reader, int protocol, UCHAR fidi, int ifsd) {
+    RESPONSECODE rv = negotiate(reader, protocol, fidi);
+    if(rv != IFD_SUCCESS && rv != IFD_ERROR_PTS_FAILURE && rv != IFD_PROTOCOL_NOT_SUPPORTED) {
+        return rv;
+    }
+
+    if(reader->protocol == 1) {
+        t1_init(&reader->t1, &reader->atr);
+        if(ifsd != reader->t1.ifsd) {
+            CHECK(t1_negotiate_ifsd(reader, ifsd));
+        }
+    }
+    return rv;
+}
+
+/* Resets the card and negotiates protocol (-1 for the one from the ATR) and
+   fidi (0 for the fastest possible). A T=1 card is then told our IFSD. */
+RESPONSECODE reset_and_negotiate(struct reader *reader, int protocol, UCHAR fidi) {
+    CHECK(fetch_atr(reader));
+    return start_protocol(reader, protocol, fidi, T1_IFSD);
+}
+
+/* IFD_RESET. A card that answers with the same ATR as before is put back
+   on the protocol and Fi/Di it ran at, which IFDHSetProtocolParameters
+   then finds in place. PPS and IFSD requests it refused are not tried
+   again. Any other ATR is negotiated from scratch. */
+RESPONSECODE warm_reset(struct reader *reader) {
+    UCHAR previous[MAX_ATR_SIZE];
+    DWORD previous_length = card_lost(reader) ? 0 : reader->cached_AtrLength;
+    memcpy(previous, reader->cached_Atr, previous_length);
+    int protocol = reader->protocol;
+    UCHAR fidi = reader->fidi;
+    int ifsd = reader->t1.ifsd;
+
+    CHECK(fetch_atr(reader));
+    if(!previous_length || previous_length != reader->cached_AtrLength || memcmp(previous, reader->cached_Atr, previous_length)) {
+        return start_protocol(reader, -1, 0, T1_IFSD);
+    }
+    return start_protocol(reader, protocol, fidi, (protocol == 1) ? ifsd : T1_IFSD);
+}
+
+RESPONSECODE power_icc(struct reader *reader, DWORD Action, PUCHAR Atr, PDWORD AtrLength) {
+    switch(Action) {
+        case IFD_RESET:
+        case IFD_POWER_UP: {
+            METRICS_INC(reader, power_ups);
+            if(Action == IFD_RESET) {
+                CHECK(warm_reset(reader));
+            } else {
+                CHECK(reset_and_negotiate(reader, -1, 0));
+            }
+
+            *AtrLength = reader->cached_AtrLength;
+            memcpy(Atr, reader->cached_Atr, reader->cached_AtrLength);
+            return IFD_SUCCESS;
+        }
+        case IFD_POWER_DOWN:
+            // The CR-75 has no vendor request that deactivates the card, it
+            // stays powered until the next reset. Forget its ATR so nothing
+            // is sent to it before IFD_POWER_UP.
+            reader->cached_AtrLength = 0;
+            *AtrLength = 0;
+            return IFD_SUCCESS;
+  }
+    return IFD_NOT_SUPPORTED;
+
+}
 
 RESPONSECODE IFDHPowerICC ( DWORD Lun, DWORD Action, 
 			    PUCHAR Atr, PDWORD AtrLength ) {
@@ -365,64 +1074,231 @@ RESPONSECODE IFDHPowerICC ( DWORD Lun, DWORD Action,
      IFD_NOT_SUPPORTED
   */
     syslog(LOG_DEBUG, "IFDHPowerICC");
+    struct reader *reader = get_reader(Lun);
+    if(!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
 
-    switch(Action) {
-        case IFD_RESET:
-        case IFD_POWER_UP: {
-            unsigned char buffer[BUFFER_SIZE];
-            CHECK_LIBUSB(libusb_control_transfer(handle, 0xc0, 161, 0xffff, 0xffff, buffer, sizeof(buffer), TIMEOUT));
+    uint64_t start = timeline_begin();
+    pthread_mutex_lock(&reader->lock);
+    RESPONSECODE rv = power_icc(reader, Action, Atr, AtrLength);
+    pthread_mutex_unlock(&reader->lock);
+    timeline_end("IFDHPowerICC", Lun >> 16, start, "action", Action);
+    return rv;
+}
 
-            *AtrLength = buffer[0];
+int parse_apdu(const UCHAR *TxBuffer, DWORD TxLength, struct apdu *apdu) {
+    // http://www.cardwerk.com/smartcards/smartcard_standard_ISO7816-4_5_basic_organizations.aspx#table5
+    memset(apdu, 0, sizeof(*apdu));
+    if(TxLength < 4) {
+        return 0;
+    }
 
-            int transferred;
-            CHECK_LIBUSB(libusb_bulk_transfer(handle, 0x86, buffer, sizeof(buffer), &transferred, TIMEOUT));
+    DWORD L = TxLength - 4; // Fixed 4-bytes header
+    const UCHAR *body = &TxBuffer[4];
 
-            if(*AtrLength != transferred) {
-                syslog(LOG_ERR, "Read invalid");
-                return IFD_COMMUNICATION_ERROR;
+    if(L == 0) {
+        apdu->iso_case = 1;
+    } else if(L == 1) {
+        apdu->iso_case = 2;
+        apdu->Le = body[0] ? body[0] : 256;
+    } else if(body[0] != 0) {
+        unsigned int B1 = body[0];
+        apdu->Lc = B1;
+        apdu->data = &body[1];
+        if(L == 1 + B1) {
+            apdu->iso_case = 3;
+        } else if(L == 2 + B1) {
+            apdu->iso_case = 4;
+            apdu->Le = body[L - 1] ? body[L - 1] : 256;
+        }
+    } else {
+        // B1 = 0 starts a 3 byte extended length
+        if(L < 3) {
+            return 0;
+        }
+        apdu->extended = 1;
+        unsigned int B2B3 = (body[1] << 8) | body[2];
+        if(L == 3) {
+            apdu->iso_case = 2;
+            apdu->Le = B2B3 ? B2B3 : 65536;
+        } else if(L > 3 && B2B3 != 0) {
+            apdu->Lc = B2B3;
+            apdu->data = &body[3];
+            if(L == 3 + B2B3) {
+                apdu->iso_case = 3;
+            } else if(L == 5 + B2B3) {
+                unsigned int Le = (body[L - 2] << 8) | body[L - 1];
+                apdu->iso_case = 4;
+                apdu->Le = Le ? Le : 65536;
             }
+        }
+    }
 
-            cached_AtrLength = *AtrLength;
-            memcpy(Atr, buffer, transferred);
-            memcpy(cached_Atr, buffer, cached_AtrLength);
+    if(!apdu->iso_case) {
+        apdu->Lc = 0;
+        apdu->data = NULL;
+    }
+    return apdu->iso_case;
+}
 
-            UCHAR command[] = {0xFF, 0x10, 0x13, 0xFC};
-            CHECK(writeMessage(command, sizeof(command)));
+/* Sends data in TPDUs of at most 255 bytes. All but the last carry the
+   chaining bit in CLA (ISO 7816-4 5.1.1.1) and have to be answered with
+   90 00, otherwise that status is returned. */
+RESPONSECODE t0_chain(struct reader *reader, const UCHAR *header, const UCHAR *data, unsigned int length, PUCHAR RxBuffer, PDWORD RxLength) {
+    DWORD RxCapacity = *RxLength;
+    unsigned int offset = 0;
+    for(;;) {
+        unsigned int segment = (length - offset > 255) ? 255 : length - offset;
+        UCHAR segment_header[5];
+        memcpy(segment_header, header, 4);
+        if(offset + segment < length) {
+            segment_header[0] |= 0x10;
+        }
+        segment_header[4] = segment;
+
+        *RxLength = RxCapacity;
+        CHECK(t0_tpdu(reader, segment_header, &data[offset], segment, 0, RxBuffer, RxLength));
+        offset += segment;
+        if(offset == length || RxBuffer[0] != 0x90 || RxBuffer[1] != 0x00) {
+            return IFD_SUCCESS;
+        }
+    }
+}
 
-            UCHAR msg[sizeof(command)];
-            CHECK(readMessage(sizeof(command), msg));
-            if(memcmp(command, msg, sizeof(command))) {
-                syslog(LOG_ERR, "Read invalid");
-                return IFD_COMMUNICATION_ERROR;
+/* Answers 61xx with GET RESPONSE and 6Cxx by repeating the command with the
+   corrected P3 (TAG_CR75_T0_GET_RESPONSE), so the application gets all data
+   in one call. RxBuffer holds the response to header, Ne is the number of
+   bytes the application asked for. Data is appended up to RxCapacity.
+   A GET RESPONSE that only yields another 61xx is a card that will never
+   run out of it, so that is an error. */
+RESPONSECODE t0_get_response(struct reader *reader, const UCHAR *header, int can_repeat, unsigned int Ne, PUCHAR RxBuffer, PDWORD RxLength, DWORD RxCapacity) {
+    DWORD received = *RxLength - 2; // data bytes before SW1 SW2
+    UCHAR command[5];
+    memcpy(command, header, 5);
+    int repeated = 0;
+
+    for(;;) {
+        UCHAR sw1 = RxBuffer[received];
+        UCHAR sw2 = RxBuffer[received + 1];
+        unsigned int available = sw2 ? sw2 : 256;
+
+        if(sw1 == 0x6C && can_repeat && !repeated) {
+            command[4] = sw2;
+            repeated = 1;
+        } else if(sw1 == 0x61 && received < Ne) {
+            unsigned int room = RxCapacity - received - 2;
+            unsigned int wanted = Ne - received;
+            if(wanted > available) {
+                wanted = available;
             }
+            if(wanted > room) {
+                wanted = room;
+            }
+            if(wanted == 0) {
+                break;
+            }
+            // GET RESPONSE on the same logical channel, without chaining
+            command[0] = (header[0] & 0x80) ? header[0] : header[0] & ~0x10;
+            command[1] = 0xC0;
+            command[2] = 0x00;
+            command[3] = 0x00;
+            command[4] = wanted & 0xFF;
+            can_repeat = 1;
+            repeated = 0;
+        } else {
+            break;
+        }
 
-            CHECK_LIBUSB(libusb_control_transfer(handle, 0x40, 165, 0xffff, 0xffff, (unsigned char*) "\x00\x13", 2, TIMEOUT));
-            return IFD_SUCCESS;
+        DWORD length = RxCapacity - received;
+        unsigned int Le = command[4] ? command[4] : 256;
+        CHECK(t0_tpdu(reader, command, NULL, 0, Le, &RxBuffer[received], &length));
+        if(command[1] == 0xC0 && length == 2 && RxBuffer[received] == 0x61) {
+            syslog(LOG_ERR, "GET RESPONSE returned no data but 61%02X", RxBuffer[received + 1]);
+            *RxLength = 0;
+            return IFD_COMMUNICATION_ERROR;
         }
-  }
-    return IFD_NOT_SUPPORTED;
+        received += length - 2;
+    }
 
+    *RxLength = received + 2;
+    return IFD_SUCCESS;
 }
 
-void apdu_message_length(PUCHAR TxBuffer, DWORD TxLength, unsigned int *Lc, unsigned int *Le) {
-    // http://www.cardwerk.com/smartcards/smartcard_standard_ISO7816-4_5_basic_organizations.aspx#table5
+/* T=0: the header goes out first, the card answers with procedure bytes.
+   Extended length APDUs are mapped onto short TPDUs as in ISO 7816-3 12.2. */
+RESPONSECODE transmit_t0(struct reader *reader, PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength) {
+    DWORD RxCapacity = *RxLength;
+    struct apdu apdu;
+    if(!parse_apdu(TxBuffer, TxLength, &apdu)) {
+        syslog(LOG_ERR, "Malformed APDU of %"PRIdword" bytes", TxLength);
+        *RxLength = 0;
+        return IFD_COMMUNICATION_ERROR;
+    }
 
-    DWORD L = TxLength - 4; // Fixed 4-bytes header
-    UCHAR B1 = TxBuffer[4];
+    UCHAR header[5] = { TxBuffer[0], TxBuffer[1], TxBuffer[2], TxBuffer[3], 0 };
+    switch(apdu.iso_case) {
+        case 1:
+            return t0_tpdu(reader, header, NULL, 0, 0, RxBuffer, RxLength);
+        case 2: {
+            // P3 = 00 asks for 256 bytes, more has to come through GET RESPONSE
+            unsigned int Ne = (apdu.Le > 256) ? 256 : apdu.Le;
+            header[4] = Ne & 0xFF;
+            CHECK(t0_tpdu(reader, header, NULL, 0, Ne, RxBuffer, RxLength));
+            break;
+        }
+        default:
+            // Case 4 goes out as case 3, the card announces its data with 61xx
+            if(apdu.Lc <= 255) {
+                header[4] = apdu.Lc;
+                CHECK(t0_tpdu(reader, header, apdu.data, apdu.Lc, 0, RxBuffer, RxLength));
+            } else if(reader->t0_envelope || (header[0] & 0x10)) {
+                UCHAR envelope[4] = { header[0] & ~0x10, 0xC2, 0x00, 0x00 };
+                CHECK(t0_chain(reader, envelope, TxBuffer, TxLength, RxBuffer, RxLength));
+            } else {
+                CHECK(t0_chain(reader, header, apdu.data, apdu.Lc, RxBuffer, RxLength));
+            }
+            break;
+    }
 
-    if(L == 0) {
-        *Lc = 0;
-        *Le = 0;
-    } else if(L == 1) {
-        *Lc = 0;
-        *Le = (TxBuffer[4]) ? TxBuffer[4] : 256;
-    } else if(L == (1 + B1) && B1 != 0) {
-        *Lc = B1;
-        *Le = 0;
-    } else if(L == (2 + B1) && B1 != 0) {
-        *Lc = B1;
-        *Le = (TxBuffer[TxLength - 1]) ? TxBuffer[TxLength - 1] : 256;
+    if(reader->t0_get_response) {
+        return t0_get_response(reader, header, apdu.iso_case == 2, apdu.Le, RxBuffer, RxLength, RxCapacity);
     }
+    return IFD_SUCCESS;
+}
+
+RESPONSECODE transmit_apdu(struct reader *reader, PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength) {
+    uint64_t start = metrics_now();
+    RESPONSECODE rv;
+    metrics_apdu(reader, TxBuffer, TxLength);
+    if(TxLength < 4) {
+        *RxLength = 0;
+        rv = IFD_COMMUNICATION_ERROR;
+    } else if(card_lost(reader)) {
+        *RxLength = 0;
+        rv = IFD_ICC_NOT_PRESENT;
+    } else if(!reader->cached_AtrLength) {
+        syslog(LOG_ERR, "Card not powered up");
+        *RxLength = 0;
+        rv = IFD_COMMUNICATION_ERROR;
+    } else if(reader->protocol == 1) {
+        rv = t1_transceive(reader, TxBuffer, TxLength, RxBuffer, RxLength);
+    } else {
+        rv = transmit_t0(reader, TxBuffer, TxLength, RxBuffer, RxLength);
+    }
+
+    // A removal cancels the transfer in flight, whatever error that gave
+    // means the card is gone along with its ATR and negotiated parameters
+    if(rv != IFD_SUCCESS && card_lost(reader)) {
+        *RxLength = 0;
+        rv = IFD_ICC_NOT_PRESENT;
+    }
+
+    if(rv != IFD_SUCCESS) {
+        METRICS_INC(reader, apdu_errors);
+    }
+    metrics_time(reader->metrics.apdu_time, start);
+    return rv;
 }
 
 RESPONSECODE IFDHTransmitToICC ( DWORD Lun, SCARD_IO_HEADER SendPci, 
@@ -470,37 +1346,86 @@ RESPONSECODE IFDHTransmitToICC ( DWORD Lun, SCARD_IO_HEADER SendPci,
      IFD_PROTOCOL_NOT_SUPPORTED
   */
     syslog(LOG_DEBUG, "IFDHTransmitToICC");
+    struct reader *reader = get_reader(Lun);
+    if(!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
 
-    unsigned int Lc, Le;
-    apdu_message_length(TxBuffer, TxLength, &Lc, &Le);
+    uint64_t start = timeline_begin();
+    pthread_mutex_lock(&reader->lock);
+    RESPONSECODE rv = transmit_apdu(reader, TxBuffer, TxLength, RxBuffer, RxLength);
+    if(RecvPci) {
+        RecvPci->Protocol = reader->protocol;
+    }
+    pthread_mutex_unlock(&reader->lock);
+    timeline_end("IFDHTransmitToICC", Lun >> 16, start, "length", TxLength);
+    return rv;
+}
 
-    if(TxLength >= 5) {
-        CHECK(writeMessage(TxBuffer, 5));
-    } else {
-        UCHAR tmpTxBuffer[5] = { 0 };
-        memcpy(tmpTxBuffer, TxBuffer, TxLength);
-        CHECK(writeMessage(tmpTxBuffer, 5));
+/* IOCTL_CR75_BATCH, see cr75.h for the format. The whole script is checked
+   before the first APDU goes out, a malformed one runs nothing. */
+RESPONSECODE run_batch(struct reader *reader, const UCHAR *script, DWORD script_length, PUCHAR RxBuffer, DWORD RxLength, PDWORD pdwBytesReturned) {
+    DWORD offset = 0;
+    while(offset < script_length) {
+        if(script_length - offset < CR75_BATCH_HEADER_SIZE) {
+            syslog(LOG_ERR, "Truncated batch entry at offset %"PRIdword, offset);
+            return IFD_COMMUNICATION_ERROR;
+        }
+        DWORD length = (script[offset + 3] << 8) | script[offset + 4];
+        offset += CR75_BATCH_HEADER_SIZE;
+        if(length < 4 || length > script_length - offset) {
+            syslog(LOG_ERR, "Invalid batch APDU length %"PRIdword, length);
+            return IFD_COMMUNICATION_ERROR;
+        }
+        offset += length;
     }
 
-    CHECK(readMessage(1, RxBuffer));
+    DWORD returned = 0;
+    unsigned int count = 0;
+    for(offset = 0; offset < script_length; count++) {
+        UCHAR flags = script[offset];
+        const UCHAR *sw = &script[offset + 1];
+        DWORD length = (script[offset + 3] << 8) | script[offset + 4];
+        const UCHAR *apdu = &script[offset + CR75_BATCH_HEADER_SIZE];
+        offset += CR75_BATCH_HEADER_SIZE + length;
+
+        if(RxLength - returned < CR75_BATCH_RECORD_HEADER_SIZE) {
+            syslog(LOG_ERR, "Batch output full after %u APDUs", count);
+            *pdwBytesReturned = returned;
+            return IFD_ERROR_INSUFFICIENT_BUFFER;
+        }
+        PUCHAR record = &RxBuffer[returned];
+        DWORD response_length = RxLength - returned - CR75_BATCH_RECORD_HEADER_SIZE;
+        if(response_length > 0xFFFF) {
+            response_length = 0xFFFF;
+        }
 
-    if(Lc > 0) {
-        CHECK(writeMessage(&TxBuffer[5], Lc));
-        CHECK(readMessage(1, RxBuffer));
-    }
+        RESPONSECODE rv = transmit_apdu(reader, (PUCHAR) apdu, length, &record[CR75_BATCH_RECORD_HEADER_SIZE], &response_length);
+        if(rv != IFD_SUCCESS) {
+            response_length = 0;
+            record[0] = CR75_BATCH_TRANSMIT_ERROR;
+        } else if((flags & CR75_BATCH_CHECK_SW) && (response_length < 2
+                || record[CR75_BATCH_RECORD_HEADER_SIZE + response_length - 2] != sw[0]
+                || (!(flags & CR75_BATCH_SW1_ONLY) && record[CR75_BATCH_RECORD_HEADER_SIZE + response_length - 1] != sw[1]))) {
+            record[0] = CR75_BATCH_SW_MISMATCH;
+        } else {
+            record[0] = CR75_BATCH_OK;
+        }
+        record[1] = response_length >> 8;
+        record[2] = response_length & 0xFF;
+        returned += CR75_BATCH_RECORD_HEADER_SIZE + response_length;
 
-    if(Le == 0 || RxBuffer[0] == 0x6c) {
-        CHECK(readMessage(1, &RxBuffer[1]));
-        *RxLength = 2;
-    } else {
-        size_t response_length = (UCHAR) TxBuffer[4] + 2; // Data + SW1 + SW2
-        if(TxLength == 5 && TxBuffer[4] == 0) {
-            response_length = 258;
+        if(rv == IFD_NO_SUCH_DEVICE || rv == IFD_ICC_NOT_PRESENT || rv == IFD_ERROR_INSUFFICIENT_BUFFER) {
+            *pdwBytesReturned = returned;
+            return rv;
+        }
+        if(record[0] != CR75_BATCH_OK && (flags & CR75_BATCH_STOP_ON_ERROR)) {
+            syslog(LOG_INFO, "Batch stopped at APDU %u", count);
+            break;
         }
-        CHECK(readMessage(response_length, RxBuffer));
-        *RxLength = response_length;
     }
 
+    *pdwBytesReturned = returned;
     return IFD_SUCCESS;
 }
 
@@ -510,7 +1435,54 @@ RESPONSECODE IFDHControl ( DWORD Lun, DWORD dwControlCode,
                            PDWORD pdwBytesReturned ) {
 
     syslog(LOG_DEBUG, "IFDHControl");
-    return IFD_NOT_SUPPORTED;
+    *pdwBytesReturned = 0;
+    struct reader *reader = get_reader(Lun);
+    if(!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    uint64_t start = timeline_begin();
+    RESPONSECODE rv = IFD_SUCCESS;
+    switch(dwControlCode) {
+        case IOCTL_CR75_BATCH:
+            pthread_mutex_lock(&reader->lock);
+            rv = run_batch(reader, TxBuffer, TxLength, RxBuffer, RxLength, pdwBytesReturned);
+            pthread_mutex_unlock(&reader->lock);
+            break;
+        case IOCTL_CR75_TRACE:
+            *pdwBytesReturned = trace_format(&reader->trace, (char *) RxBuffer, RxLength);
+            break;
+        case IOCTL_CR75_METRICS: {
+            // Lock free, a scrape doesn't wait for a running APDU
+            struct cr75_metrics metrics;
+            if(RxLength < sizeof(metrics)) {
+                rv = IFD_ERROR_INSUFFICIENT_BUFFER;
+                break;
+            }
+            metrics_snapshot(reader, &metrics);
+            memcpy(RxBuffer, &metrics, sizeof(metrics));
+            *pdwBytesReturned = sizeof(metrics);
+            break;
+        }
+        default:
+            rv = IFD_NOT_SUPPORTED;
+            break;
+    }
+    timeline_end("IFDHControl", Lun >> 16, start, "code", dwControlCode);
+    return rv;
+}
+
+/* Declared in cr75.h. Only reads the rings and calls write(), so it may
+   run in a signal handler, even while a reader is being traced. */
+int cr75_trace_dump(int fd) {
+    int rv = 0;
+    int i;
+    for(i = 0; i < MAX_READERS; i++) {
+        if(ATOMIC_LOAD(readers[i].in_use) && trace_write(&readers[i].trace, fd)) {
+            rv = -1;
+        }
+    }
+    return rv;
 }
 
 RESPONSECODE IFDHICCPresence( DWORD Lun ) {
@@ -522,7 +1494,14 @@ RESPONSECODE IFDHICCPresence( DWORD Lun ) {
      IFD_ICC_NOT_PRESENT
      IFD_COMMUNICATION_ERROR
   */
-    struct timeval tv = {0};
-    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
-    return card_present;
+    struct reader *reader = get_reader(Lun);
+    if(!reader) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    uint64_t start = timeline_begin();
+    ATOMIC_STORE(reader->presence_changed, 0);
+    reader->transport->wait(reader, 0, NULL);
+    RESPONSECODE rv = ATOMIC_LOAD(reader->card_present);
+    timeline_end("IFDHICCPresence", Lun >> 16, start, "rv", rv);
+    return rv;
 }
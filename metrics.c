@@ -0,0 +1,66 @@
+/*****************************************************************
+/
+/ File   :   metrics.c
+/ Date   :   October 16, 2026
+/ Purpose:   Lock-free per-reader counters and latency histograms.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "reader.h"
+#include <string.h>
+#include <time.h>
+
+/* Monotonic time in nanoseconds */
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Adds the time since start to a log2 histogram of microseconds */
+void metrics_time(uint64_t *histogram, uint64_t start) {
+    uint64_t us = (metrics_now() - start) / 1000;
+    int bucket = us ? 63 - __builtin_clzll(us) : 0;
+    if(bucket >= CR75_HISTOGRAM_BUCKETS) {
+        bucket = CR75_HISTOGRAM_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/* Counts a failed libusb call by the response code it maps to */
+void metrics_usb_error(struct reader *reader, int err) {
+    switch(libusb_error_to_responsecode(err)) {
+        case IFD_RESPONSE_TIMEOUT:
+            METRICS_INC(reader, timeouts);
+            break;
+        case IFD_NO_SUCH_DEVICE:
+            METRICS_INC(reader, no_device);
+            break;
+        default:
+            METRICS_INC(reader, communication_errors);
+    }
+}
+
+void metrics_apdu(struct reader *reader, const UCHAR *TxBuffer, DWORD TxLength) {
+    struct apdu apdu;
+    int index = 0;
+    if(parse_apdu(TxBuffer, TxLength, &apdu)) {
+        index = (apdu.extended && apdu.iso_case > 1) ? apdu.iso_case + 3 : apdu.iso_case;
+    }
+    METRICS_INC(reader, apdus[index]);
+}
+
+/* Copies the counters one by one, the result is not an atomic snapshot of
+   all of them but every single counter is consistent */
+void metrics_snapshot(struct reader *reader, struct cr75_metrics *metrics) {
+    const uint64_t *from = reader->metrics.apdus;
+    uint64_t *to = metrics->apdus;
+    size_t i;
+    size_t count = (sizeof(*metrics) - offsetof(struct cr75_metrics, apdus)) / sizeof(uint64_t);
+    for(i = 0; i < count; i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+    metrics->version = CR75_METRICS_VERSION;
+    metrics->size = sizeof(*metrics);
+}
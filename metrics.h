@@ -0,0 +1,29 @@
+/*****************************************************************
+/
+/ File   :   metrics.h
+/ Date   :   October 16, 2026
+/ Purpose:   Lock-free per-reader counters and latency histograms.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _metrics_h_
+#define _metrics_h_
+
+#include "ifdhandler.h"
+#include "cr75.h"
+
+/* Counters are bumped from the transmitting thread and libusb callbacks
+   and read by whoever scrapes them, without taking the reader lock */
+#define METRICS_ADD(reader, field, v) __atomic_fetch_add(&(reader)->metrics.field, (v), __ATOMIC_RELAXED)
+#define METRICS_INC(reader, field) METRICS_ADD(reader, field, 1)
+
+struct reader;
+
+uint64_t metrics_now(void);
+void metrics_time(uint64_t *histogram, uint64_t start);
+void metrics_usb_error(struct reader *reader, int err);
+void metrics_apdu(struct reader *reader, const UCHAR *TxBuffer, DWORD TxLength);
+void metrics_snapshot(struct reader *reader, struct cr75_metrics *metrics);
+
+#endif
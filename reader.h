@@ -0,0 +1,130 @@
+/*****************************************************************
+/
+/ File   :   reader.h
+/ Date   :   October 16, 2026
+/ Purpose:   Per-reader state and transport shared by the protocol code.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _reader_h_
+#define _reader_h_
+
+#include "ifdhandler.h"
+#include "atr.h"
+#include "t0.h"
+#include "t1.h"
+#include "metrics.h"
+#include "trace.h"
+#include "transport.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#define CACHE_LINE_SIZE 64
+#define MAX_READERS 16 /* matches PCSCLITE_MAX_READERS_CONTEXTS */
+#define BUFFER_SIZE 16 /* bulk chunk size of the CR-75 firmware */
+#define ASYNC_DEPTH 4 /* bulk OUT chunks in flight per message */
+#define ARMED_SIZE 64 /* largest first bulk IN of a response that is submitted ahead */
+
+#define CHECK(x) do { \
+    RESPONSECODE retval = (x); \
+    if (retval != 0) { \
+        return retval; \
+    } \
+} while (0)
+#define CHECK_LIBUSB(x) do { \
+    int retval = (x); \
+    if (retval < 0) { \
+        return libusb_error_to_responsecode(retval); \
+    } \
+} while (0)
+
+/* Presence state is written from libusb event callbacks, which may run on
+   the polling thread while another thread is transmitting */
+#define ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+#ifdef __APPLE__
+#define PRIdword "u"
+#else
+#define PRIdword "lu"
+#endif
+
+/* State of one CR-75, each reader is padded to its own cache line(s) so
+   readers driven from different pcscd threads don't share lines. */
+struct reader {
+    int in_use;
+    pthread_mutex_t lock; /* serializes all transfers to the reader */
+    const struct transport *transport;
+    void *transport_data; /* owned by the transport */
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    struct libusb_transfer *transfer;
+    struct libusb_transfer *bulk; /* carries usb_bulk(), cancelled when the card is pulled */
+    struct libusb_transfer *in; /* bulk IN submitted by usb_arm_in(), cancelled likewise */
+    /* Cleared before bulk, in or out[] is submitted and set again by its callback,
+       atomic. MonitorCardPresence only cancels a transfer that is in flight. */
+    int bulk_completed;
+    int in_completed;
+    int in_armed; /* in was submitted by usb_arm_in() and usb_bulk() has not taken it yet */
+    struct libusb_transfer *out[ASYNC_DEPTH]; /* chunks of usb_write_async(), cancelled likewise */
+    int out_completed[ASYNC_DEPTH];
+    int monitoring; /* the transport still reports presence changes (0x84) */
+    uint8_t bus;
+    uint8_t address;
+
+    /* wMaxPacketSize of the bulk IN endpoint, responses are read in multiples of it */
+    int in_packet_size;
+    /* First bulk IN of the response to the last writeCommand, pending on the
+       transport until readResponse picks it up */
+    int armed_length; /* 0 if nothing is armed */
+    int armed_expected;
+    UCHAR armed[ARMED_SIZE];
+
+    struct atr atr; /* decoded from cached_Atr */
+    int protocol; /* T=0 or T=1, as selected by the ATR or PPS */
+    UCHAR fidi; /* TA1-coded Fi/Di the card and reader are running at */
+    struct t1 t1;
+    int t0_envelope; /* TAG_CR75_T0_ENVELOPE */
+    int t0_get_response; /* TAG_CR75_T0_GET_RESPONSE */
+    int t0_combined; /* TAG_CR75_T0_COMBINED */
+    /* Read from the environment when the channel is opened */
+    int async_depth; /* CR75_ASYNC_DEPTH, bulk OUT chunks kept queued, 0 for synchronous transfers */
+    unsigned int card_clock; /* CR75_CARD_CLOCK, in kHz */
+    unsigned int control_timeout; /* CR75_CONTROL_TIMEOUT, in ms */
+    uint8_t t0_acked[32]; /* bitmap of INS values the card ACKed right after the header */
+    struct cr75_metrics metrics; /* only the counters are used, see metrics_snapshot */
+    struct trace trace;
+
+    RESPONSECODE card_present;
+    int presence_changed; /* set by MonitorCardPresence, cleared by IFDHICCPresence */
+    int card_removed; /* removal reported since the last insertion, transfers fail fast */
+    unsigned int removals; /* removals reported so far */
+    unsigned int atr_removals; /* removals before cached_Atr was read, see card_lost */
+    int stop_polling;
+    UCHAR cached_Atr[MAX_ATR_SIZE];
+    DWORD cached_AtrLength;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* A command APDU split up as in ISO 7816-4 5.1 */
+struct apdu {
+    int iso_case;       /* 1 to 4, 0 if malformed */
+    int extended;       /* Lc and Le use the 3 byte encoding */
+    unsigned int Lc;
+    unsigned int Le;    /* Ne, 0 if no response data is expected */
+    const UCHAR *data;  /* Lc bytes of command data */
+};
+
+extern struct reader readers[MAX_READERS];
+
+int parse_apdu(const UCHAR *TxBuffer, DWORD TxLength, struct apdu *apdu);
+RESPONSECODE libusb_error_to_responsecode(const int err);
+void set_card_present(struct reader *reader, int present);
+RESPONSECODE writeMessage(struct reader *reader, PUCHAR msg, size_t length);
+RESPONSECODE writeCommand(struct reader *reader, PUCHAR msg, size_t length, int response_length);
+RESPONSECODE readResponse(struct reader *reader, int expected_length, PUCHAR msg, DWORD capacity, PDWORD received);
+RESPONSECODE readMessage(struct reader *reader, int expected_length, PUCHAR msg, DWORD capacity);
+
+#endif
@@ -0,0 +1,408 @@
+/*****************************************************************
+/
+/ File   :   record.c
+/ Date   :   October 16, 2026
+/ Purpose:   Transports that record a libusb session to a binary
+/            transcript and replay it without hardware.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "reader.h"
+#include <syslog.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+/* A transcript starts with "CR75", the version, wMaxPacketSize of 0x86 (2
+   bytes) and the presence state at open (1 byte). Every event follows as
+   its kind, duration in us (4 bytes), result (4 bytes) and:
+     'C' type, request, wIndex (2), wLength (2), the bytes sent or received
+     'B' endpoint, length (4), transferred (4), the bytes sent or received
+     'P' IFD_ICC_PRESENT or not (1)
+   All numbers are little endian. */
+#define TRANSCRIPT_MAGIC "CR75"
+#define TRANSCRIPT_VERSION 1
+
+#define EVENT_CONTROL 'C'
+#define EVENT_BULK 'B'
+#define EVENT_PRESENCE 'P'
+
+struct transcript {
+    FILE *file;
+    pthread_mutex_t lock; /* transfers and wait() run on different threads */
+    pthread_cond_t wake;
+    int interrupted;
+    int latency;        /* replay: sleep the recorded durations */
+    int present;        /* last presence state written or read */
+};
+
+static void put_u16(FILE *file, unsigned int value) {
+    putc(value & 0xFF, file);
+    putc((value >> 8) & 0xFF, file);
+}
+
+static void put_u32(FILE *file, uint32_t value) {
+    put_u16(file, value & 0xFFFF);
+    put_u16(file, value >> 16);
+}
+
+static int get_u16(FILE *file, unsigned int *value) {
+    int low = getc(file);
+    int high = getc(file);
+    *value = low | (high << 8);
+    return low == EOF || high == EOF ? -1 : 0;
+}
+
+static int get_u32(FILE *file, uint32_t *value) {
+    unsigned int low, high;
+    if(get_u16(file, &low) || get_u16(file, &high)) {
+        return -1;
+    }
+    *value = low | ((uint32_t) high << 16);
+    return 0;
+}
+
+/* Transcript of reader, CR75_RECORD or CR75_REPLAY followed by the index
+   of the reader */
+static struct transcript *open_transcript(struct reader *reader, const char *variable, const char *mode) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%i", getenv(variable), (int) (reader - readers));
+
+    struct transcript *transcript = calloc(1, sizeof(*transcript));
+    if(!transcript) {
+        return NULL;
+    }
+    transcript->file = fopen(path, mode);
+    if(!transcript->file) {
+        syslog(LOG_ERR, "Cannot open transcript %s", path);
+        free(transcript);
+        return NULL;
+    }
+    pthread_mutex_init(&transcript->lock, NULL);
+    pthread_cond_init(&transcript->wake, NULL);
+    reader->transport_data = transcript;
+    syslog(LOG_INFO, "Using transcript %s", path);
+    return transcript;
+}
+
+static void close_transcript(struct reader *reader) {
+    struct transcript *transcript = reader->transport_data;
+    if(!transcript) {
+        return;
+    }
+    fclose(transcript->file);
+    pthread_cond_destroy(&transcript->wake);
+    pthread_mutex_destroy(&transcript->lock);
+    free(transcript);
+    reader->transport_data = NULL;
+}
+
+static void put_event(FILE *file, int kind, uint64_t start, int result) {
+    putc(kind, file);
+    put_u32(file, (metrics_now() - start) / 1000);
+    put_u32(file, result);
+}
+
+/* Recorder, wraps usb_transport. Bulk OUT goes through bulk() chunk by
+   chunk and bulk IN is not armed ahead, so write_async and arm_in are not
+   used while recording. */
+
+static RESPONSECODE record_open(struct reader *reader, const struct device_match *match) {
+    CHECK(usb_transport.open(reader, match));
+    struct transcript *transcript = open_transcript(reader, "CR75_RECORD", "wb");
+    if(!transcript) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    transcript->present = ATOMIC_LOAD(reader->card_present);
+    fputs(TRANSCRIPT_MAGIC, transcript->file);
+    putc(TRANSCRIPT_VERSION, transcript->file);
+    put_u16(transcript->file, reader->in_packet_size);
+    putc(transcript->present == IFD_ICC_PRESENT, transcript->file);
+    return IFD_SUCCESS;
+}
+
+static void record_close(struct reader *reader) {
+    usb_transport.close(reader);
+    close_transcript(reader);
+}
+
+/* Presence changes are delivered by libusb while handling events, which
+   also happens inside synchronous transfers. Called with the transcript
+   locked after every operation. */
+static void record_presence(struct reader *reader, struct transcript *transcript) {
+    RESPONSECODE present = ATOMIC_LOAD(reader->card_present);
+    if(present != transcript->present) {
+        transcript->present = present;
+        put_event(transcript->file, EVENT_PRESENCE, metrics_now(), 0);
+        putc(present == IFD_ICC_PRESENT, transcript->file);
+    }
+}
+
+static int record_control(struct reader *reader, uint8_t type, uint8_t request, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout) {
+    struct transcript *transcript = reader->transport_data;
+    uint64_t start = metrics_now();
+    int err = usb_transport.control(reader, type, request, index, data, length, timeout);
+
+    pthread_mutex_lock(&transcript->lock);
+    record_presence(reader, transcript);
+    put_event(transcript->file, EVENT_CONTROL, start, err);
+    putc(type, transcript->file);
+    putc(request, transcript->file);
+    put_u16(transcript->file, index);
+    put_u16(transcript->file, length);
+    if(type & LIBUSB_ENDPOINT_IN) {
+        fwrite(data, 1, (err > 0) ? err : 0, transcript->file);
+    } else {
+        fwrite(data, 1, length, transcript->file);
+    }
+    pthread_mutex_unlock(&transcript->lock);
+    return err;
+}
+
+static int record_bulk(struct reader *reader, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+    struct transcript *transcript = reader->transport_data;
+    uint64_t start = metrics_now();
+    *transferred = 0;
+    int err = usb_transport.bulk(reader, endpoint, data, length, transferred, timeout);
+
+    pthread_mutex_lock(&transcript->lock);
+    record_presence(reader, transcript);
+    put_event(transcript->file, EVENT_BULK, start, err);
+    putc(endpoint, transcript->file);
+    put_u32(transcript->file, length);
+    put_u32(transcript->file, *transferred);
+    fwrite(data, 1, (endpoint & LIBUSB_ENDPOINT_IN) ? *transferred : length, transcript->file);
+    pthread_mutex_unlock(&transcript->lock);
+    return err;
+}
+
+static int record_wait(struct reader *reader, int timeout, int *completed) {
+    struct transcript *transcript = reader->transport_data;
+    int err = usb_transport.wait(reader, timeout, completed);
+
+    pthread_mutex_lock(&transcript->lock);
+    record_presence(reader, transcript);
+    pthread_mutex_unlock(&transcript->lock);
+    return err;
+}
+
+static void record_interrupt(struct reader *reader) {
+    usb_transport.interrupt(reader);
+}
+
+const struct transport record_transport = {
+    "record",
+    record_open,
+    record_close,
+    record_control,
+    record_bulk,
+    NULL,
+    NULL,
+    record_wait,
+    record_interrupt
+};
+
+/* Replay, serves a transcript in order. A transfer that doesn't match the
+   next recorded one fails with LIBUSB_ERROR_IO, the end of the transcript
+   looks like the reader being unplugged. */
+
+static RESPONSECODE replay_open(struct reader *reader, const struct device_match *match) {
+    struct transcript *transcript = open_transcript(reader, "CR75_REPLAY", "rb");
+    if(!transcript) {
+        return IFD_NO_SUCH_DEVICE;
+    }
+    const char *latency = getenv("CR75_REPLAY_LATENCY");
+    transcript->latency = latency && atoi(latency);
+
+    char magic[4];
+    unsigned int packet_size;
+    if(fread(magic, 1, sizeof(magic), transcript->file) != sizeof(magic) || memcmp(magic, TRANSCRIPT_MAGIC, sizeof(magic))
+            || getc(transcript->file) != TRANSCRIPT_VERSION || get_u16(transcript->file, &packet_size)) {
+        syslog(LOG_ERR, "Not a version %i transcript", TRANSCRIPT_VERSION);
+        return IFD_COMMUNICATION_ERROR;
+    }
+    transcript->present = getc(transcript->file) == 1;
+    reader->in_packet_size = packet_size ? packet_size : BUFFER_SIZE;
+    ATOMIC_STORE(reader->card_present, transcript->present ? IFD_ICC_PRESENT : IFD_ICC_NOT_PRESENT);
+    ATOMIC_STORE(reader->monitoring, 1);
+    return IFD_SUCCESS;
+}
+
+static void replay_close(struct reader *reader) {
+    close_transcript(reader);
+}
+
+static void replay_sleep(struct transcript *transcript, uint32_t duration) {
+    if(transcript->latency && duration) {
+        struct timespec delay = { duration / 1000000, (duration % 1000000) * 1000L };
+        nanosleep(&delay, NULL);
+    }
+}
+
+static void replay_ended(struct reader *reader) {
+    syslog(LOG_INFO, "End of transcript");
+    set_card_present(reader, 0);
+    ATOMIC_STORE(reader->monitoring, 0);
+}
+
+/* Reads the header of the next event, applying presence events on the way
+   unless only_presence is set, which leaves the next transfer unread.
+   Returns the kind, or EOF. Called with the transcript locked. */
+static int replay_next(struct reader *reader, uint32_t *duration, uint32_t *result, int only_presence) {
+    struct transcript *transcript = reader->transport_data;
+    for(;;) {
+        int kind = getc(transcript->file);
+        if(only_presence && kind != EVENT_PRESENCE && kind != EOF) {
+            ungetc(kind, transcript->file);
+            return kind;
+        }
+        if(kind == EOF || get_u32(transcript->file, duration) || get_u32(transcript->file, result)) {
+            replay_ended(reader);
+            return EOF;
+        }
+        if(kind != EVENT_PRESENCE) {
+            return kind;
+        }
+        transcript->present = getc(transcript->file) == 1;
+        set_card_present(reader, transcript->present);
+    }
+}
+
+/* Consumes length bytes of recorded data, copying them to data if given */
+static int replay_data(FILE *file, unsigned char *data, size_t length) {
+    size_t i;
+    for(i = 0; i < length; i++) {
+        int c = getc(file);
+        if(c == EOF) {
+            return -1;
+        }
+        if(data) {
+            data[i] = c;
+        }
+    }
+    return 0;
+}
+
+/* Replays recorded results, timeouts included, so the timeout is unused */
+static int replay_control(struct reader *reader, uint8_t type, uint8_t request, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout) {
+    struct transcript *transcript = reader->transport_data;
+    uint32_t duration, result;
+    unsigned int recorded_index, recorded_length;
+
+    pthread_mutex_lock(&transcript->lock);
+    int kind = replay_next(reader, &duration, &result, 0);
+    if(kind == EOF) {
+        pthread_mutex_unlock(&transcript->lock);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    int recorded_type = getc(transcript->file);
+    int recorded_request = getc(transcript->file);
+    int err = (int32_t) result;
+    if(kind != EVENT_CONTROL || get_u16(transcript->file, &recorded_index) || get_u16(transcript->file, &recorded_length)
+            || recorded_type != type || recorded_request != request || recorded_index != index) {
+        syslog(LOG_ERR, "Transcript diverged at vendor request %i", request);
+        pthread_mutex_unlock(&transcript->lock);
+        return LIBUSB_ERROR_IO;
+    }
+
+    if(type & LIBUSB_ENDPOINT_IN) {
+        size_t recorded = (err > 0) ? err : 0;
+        if(recorded > length || replay_data(transcript->file, data, recorded)) {
+            err = LIBUSB_ERROR_OVERFLOW;
+        }
+    } else if(replay_data(transcript->file, NULL, recorded_length)) {
+        err = LIBUSB_ERROR_IO;
+    }
+    pthread_mutex_unlock(&transcript->lock);
+    replay_sleep(transcript, duration);
+    return err;
+}
+
+static int replay_bulk(struct reader *reader, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+    struct transcript *transcript = reader->transport_data;
+    uint32_t duration, result, recorded_length, recorded_transferred;
+
+    *transferred = 0;
+    pthread_mutex_lock(&transcript->lock);
+    int kind = replay_next(reader, &duration, &result, 0);
+    if(kind == EOF) {
+        pthread_mutex_unlock(&transcript->lock);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    int recorded_endpoint = getc(transcript->file);
+    if(kind != EVENT_BULK || recorded_endpoint != endpoint || get_u32(transcript->file, &recorded_length)
+            || get_u32(transcript->file, &recorded_transferred)) {
+        syslog(LOG_ERR, "Transcript diverged at bulk transfer on %02X", endpoint);
+        pthread_mutex_unlock(&transcript->lock);
+        return LIBUSB_ERROR_IO;
+    }
+
+    int err = (int32_t) result;
+    if(endpoint & LIBUSB_ENDPOINT_IN) {
+        if(recorded_transferred > (uint32_t) length || replay_data(transcript->file, data, recorded_transferred)) {
+            err = LIBUSB_ERROR_OVERFLOW;
+        } else {
+            *transferred = recorded_transferred;
+        }
+    } else if(replay_data(transcript->file, NULL, recorded_length)) {
+        err = LIBUSB_ERROR_IO;
+    } else {
+        *transferred = recorded_transferred;
+    }
+    pthread_mutex_unlock(&transcript->lock);
+    replay_sleep(transcript, duration);
+    return err;
+}
+
+/* Sleeps on wake for timeout ms like wait() does, with lock held */
+void transport_sleep(pthread_cond_t *wake, pthread_mutex_t *lock, int timeout) {
+    if(timeout == 0) {
+        return;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (timeout < 0) ? 60 : timeout / 1000;
+    deadline.tv_nsec += (timeout < 0) ? 0 : (timeout % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(wake, lock, &deadline);
+}
+
+/* Presence events are delivered once the transfers recorded before them
+   have been replayed, until then wait() just sleeps */
+static int replay_wait(struct reader *reader, int timeout, int *completed) {
+    struct transcript *transcript = reader->transport_data;
+    uint32_t duration, result;
+    pthread_mutex_lock(&transcript->lock);
+    replay_next(reader, &duration, &result, 1);
+    if(!(completed && ATOMIC_LOAD(*completed)) && !transcript->interrupted) {
+        transport_sleep(&transcript->wake, &transcript->lock, timeout);
+    }
+    transcript->interrupted = 0;
+    pthread_mutex_unlock(&transcript->lock);
+    return 0;
+}
+
+static void replay_interrupt(struct reader *reader) {
+    struct transcript *transcript = reader->transport_data;
+    pthread_mutex_lock(&transcript->lock);
+    transcript->interrupted = 1;
+    pthread_cond_broadcast(&transcript->wake);
+    pthread_mutex_unlock(&transcript->lock);
+}
+
+const struct transport replay_transport = {
+    "replay",
+    replay_open,
+    replay_close,
+    replay_control,
+    replay_bulk,
+    NULL,
+    NULL,
+    replay_wait,
+    replay_interrupt
+};
@@ -0,0 +1,183 @@
+/*****************************************************************
+/
+/ File   :   t0.c
+/ Date   :   October 16, 2026
+/ Purpose:   ISO 7816-3 T=0 character transmission protocol.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "reader.h"
+#include <syslog.h>
+#include <string.h>
+
+int is_sw1(UCHAR b) {
+    return ((b & 0xF0) == 0x60 && b != T0_NULL) || (b & 0xF0) == 0x90;
+}
+
+/* Reads the remaining Le bytes of data announced by an ACK together with
+   the status that has to follow, unless NULLs come in between. A response
+   the reader cut short counts if it ends in a status word. Returns the
+   number of bytes in RxBuffer, data and SW1 SW2. */
+static RESPONSECODE t0_receive_all(struct reader *reader, unsigned int Le, PUCHAR RxBuffer, DWORD RxCapacity, PDWORD RxLength) {
+    DWORD received;
+    CHECK(readResponse(reader, Le + 2, RxBuffer, RxCapacity, &received));
+    if(received < Le + 2) {
+        if(received < 2 || !is_sw1(RxBuffer[received - 2])) {
+            syslog(LOG_ERR, "T=0 response ended after %"PRIdword" of %u bytes", received, Le + 2);
+            return IFD_COMMUNICATION_ERROR;
+        }
+        *RxLength = received;
+        return IFD_SUCCESS;
+    }
+
+    while(RxBuffer[Le] == T0_NULL) {
+        RxBuffer[Le] = RxBuffer[Le + 1];
+        CHECK(readMessage(reader, 1, &RxBuffer[Le + 1], 1));
+    }
+    if(!is_sw1(RxBuffer[Le])) {
+        syslog(LOG_ERR, "T=0 procedure byte %02X after all data", RxBuffer[Le]);
+        return IFD_COMMUNICATION_ERROR;
+    }
+    *RxLength = Le + 2;
+    return IFD_SUCCESS;
+}
+
+static int t0_acked(const struct reader *reader, UCHAR ins) {
+    return reader->t0_acked[ins >> 3] & (1 << (ins & 7));
+}
+
+/* Remembers whether the card answered the header of a command with data
+   directly with an ACK, which makes sending the data ahead safe */
+static void t0_learn(struct reader *reader, UCHAR ins, int acked) {
+    if(acked) {
+        reader->t0_acked[ins >> 3] |= 1 << (ins & 7);
+    } else {
+        reader->t0_acked[ins >> 3] &= ~(1 << (ins & 7));
+    }
+}
+
+/* Procedure bytes and status read ahead, used up before reading more */
+struct t0_pending {
+    UCHAR bytes[3];
+    DWORD length;
+    DWORD offset;
+};
+
+static RESPONSECODE t0_read_byte(struct reader *reader, struct t0_pending *pending, PUCHAR b) {
+    if(pending->offset < pending->length) {
+        *b = pending->bytes[pending->offset++];
+        return IFD_SUCCESS;
+    }
+    return readMessage(reader, 1, b, 1);
+}
+
+/* Exchanges one T=0 command TPDU: the 5-byte header, then either Lc bytes of
+   command data or Le bytes of response data, followed by SW1 SW2.
+
+   After the header the card drives the exchange with procedure bytes:
+   - NULL (60) asks for more time, WWT starts again
+   - ACK (INS) asks for all remaining data
+   - INS complement asks for the next single byte
+   - SW1 ends the command, possibly before all data was transferred
+
+   With TAG_CR75_T0_COMBINED the command data goes out together with the
+   header if the card ACKed the same INS before, and the ACK is read in one
+   go with the status expected after it. The procedure bytes are then only
+   checked against the data already sent. A card that answers with a status
+   before taking that data may read it as the next header, so the command
+   fails and the INS goes back to being sent header first. */
+RESPONSECODE t0_tpdu(struct reader *reader, const UCHAR *header, const UCHAR *data, unsigned int Lc, unsigned int Le, PUCHAR RxBuffer, PDWORD RxLength) {
+    DWORD RxCapacity = *RxLength;
+    unsigned int sent = 0;      // command data written to the reader
+    unsigned int requested = 0; // command data the card asked for
+    unsigned int received = 0;
+    int first = 1;              // no procedure byte other than NULL yet
+    struct t0_pending pending = { { 0 }, 0, 0 };
+    UCHAR ins = header[1];
+
+    *RxLength = 0;
+    if(RxCapacity < 2 + (Lc ? 0 : Le)) {
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+    }
+
+    if(Lc > 0 && reader->t0_combined && t0_acked(reader, ins)) {
+        UCHAR message[5 + 255];
+        memcpy(message, header, 5);
+        memcpy(&message[5], data, Lc);
+        sent = Lc;
+        // Without response data ACK SW1 SW2 is all that should come back. A
+        // refusing card sends only SW1 SW2, and the reader may time out
+        // waiting for the third byte instead of passing them on.
+        RESPONSECODE rv = writeCommand(reader, message, 5 + Lc, 3);
+        if(rv == IFD_SUCCESS) {
+            rv = readResponse(reader, 3, pending.bytes, sizeof(pending.bytes), &pending.length);
+        }
+        if(rv != IFD_SUCCESS) {
+            t0_learn(reader, ins, 0);
+            return rv;
+        }
+    } else {
+        CHECK(writeCommand(reader, (PUCHAR) header, 5, 1));
+    }
+
+    for(;;) {
+        UCHAR procedure;
+        CHECK(t0_read_byte(reader, &pending, &procedure));
+
+        if(procedure == T0_NULL) {
+            continue;
+        }
+        if(first && Lc > 0) {
+            t0_learn(reader, ins, procedure == ins);
+            first = 0;
+        }
+        if(is_sw1(procedure)) {
+            if(requested < sent) {
+                syslog(LOG_ERR, "T=0 card answered INS %02X with %02X before taking the data sent ahead", ins, procedure);
+                return IFD_COMMUNICATION_ERROR;
+            }
+            RxBuffer[received] = procedure;
+            CHECK(t0_read_byte(reader, &pending, &RxBuffer[received + 1]));
+            *RxLength = received + 2;
+            return IFD_SUCCESS;
+        }
+
+        int all;
+        if(procedure == ins) {
+            all = 1;
+        } else if(procedure == (UCHAR) ~ins) {
+            all = 0;
+        } else {
+            syslog(LOG_ERR, "Invalid T=0 procedure byte %02X for INS %02X", procedure, ins);
+            return IFD_COMMUNICATION_ERROR;
+        }
+
+        if(Lc > 0) {
+            if(requested == Lc) {
+                syslog(LOG_ERR, "T=0 card asks for more than %u bytes", Lc);
+                return IFD_COMMUNICATION_ERROR;
+            }
+            unsigned int count = all ? Lc - requested : 1;
+            if(requested >= sent) {
+                CHECK(writeCommand(reader, (PUCHAR) &data[sent], count, 1));
+                sent += count;
+            }
+            requested += count;
+        } else if(Le > 0) {
+            if(received == Le) {
+                syslog(LOG_ERR, "T=0 card offers more than %u bytes", Le);
+                return IFD_COMMUNICATION_ERROR;
+            }
+            if(all) {
+                DWORD length;
+                CHECK(t0_receive_all(reader, Le - received, &RxBuffer[received], RxCapacity - received, &length));
+                *RxLength = received + length;
+                return IFD_SUCCESS;
+            }
+            CHECK(readMessage(reader, 1, &RxBuffer[received], 1));
+            received++;
+        }
+        // Case 1: an ACK has nothing to transfer, wait for the status
+    }
+}
@@ -0,0 +1,22 @@
+/*****************************************************************
+/
+/ File   :   t0.h
+/ Date   :   October 16, 2026
+/ Purpose:   ISO 7816-3 T=0 character transmission protocol.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _t0_h_
+#define _t0_h_
+
+#include "ifdhandler.h"
+
+#define T0_NULL 0x60
+
+struct reader;
+
+int is_sw1(UCHAR b);
+RESPONSECODE t0_tpdu(struct reader *reader, const UCHAR *header, const UCHAR *data, unsigned int Lc, unsigned int Le, PUCHAR RxBuffer, PDWORD RxLength);
+
+#endif
@@ -0,0 +1,279 @@
+/*****************************************************************
+/
+/ File   :   t1.c
+/ Date   :   October 16, 2026
+/ Purpose:   ISO 7816-3 T=1 block transmission protocol.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "reader.h"
+#include <syslog.h>
+#include <string.h>
+
+#define T1_RETRIES 3 /* retransmissions before a resynchronization */
+
+#define T1_R_BLOCK 0x80
+#define T1_S_BLOCK 0xC0
+#define T1_NS 0x40 /* N(S) in an I-block */
+#define T1_MORE 0x20 /* M bit in an I-block */
+#define T1_NR 0x10 /* N(R) in an R-block */
+#define T1_S_RESPONSE 0x20
+
+#define T1_S_RESYNCH 0x00
+#define T1_S_IFS 0x01
+#define T1_S_ABORT 0x02
+#define T1_S_WTX 0x03
+
+#define T1_EDC_ERROR 0x01
+#define T1_OTHER_ERROR 0x02
+
+#define IS_I_BLOCK(pcb) (!((pcb) & 0x80))
+#define IS_R_BLOCK(pcb) (((pcb) & 0xC0) == T1_R_BLOCK)
+
+void t1_init(struct t1 *t1, const struct atr *atr) {
+    t1->nad = 0;
+    t1->ns = 0;
+    t1->nr = 0;
+    t1->ifsc = (atr->ifsc >= 1 && atr->ifsc <= T1_MAX_INF) ? atr->ifsc : 32;
+    t1->initial_ifsc = t1->ifsc;
+    t1->ifsd = 32;
+    t1->crc = atr->crc;
+    t1->wtx = 0;
+}
+
+static unsigned short crc16(const UCHAR *data, size_t length) {
+    // ISO/IEC 13239, x^16 + x^12 + x^5 + 1, bit-reversed
+    unsigned short crc = 0xFFFF;
+    size_t i;
+    int bit;
+    for(i = 0; i < length; i++) {
+        crc ^= data[i];
+        for(bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+/* Appends the epilogue to block and returns its length */
+static size_t t1_edc(const struct t1 *t1, UCHAR *block, size_t length) {
+    if(t1->crc) {
+        unsigned short crc = crc16(block, length);
+        block[length] = crc >> 8;
+        block[length + 1] = crc & 0xFF;
+        return 2;
+    }
+
+    UCHAR lrc = 0;
+    size_t i;
+    for(i = 0; i < length; i++) {
+        lrc ^= block[i];
+    }
+    block[length] = lrc;
+    return 1;
+}
+
+static size_t t1_build(const struct t1 *t1, UCHAR pcb, const UCHAR *inf, size_t length, UCHAR *block) {
+    block[0] = t1->nad;
+    block[1] = pcb;
+    block[2] = length;
+    if(length) {
+        memcpy(&block[3], inf, length);
+    }
+    return 3 + length + t1_edc(t1, block, 3 + length);
+}
+
+/* Builds the I-block carrying the APDU bytes from offset on */
+static size_t t1_build_i_block(const struct t1 *t1, const UCHAR *apdu, DWORD apdu_length, DWORD offset, size_t *chunk, UCHAR *block) {
+    DWORD remaining = apdu_length - offset;
+    *chunk = (remaining > (DWORD) t1->ifsc) ? (DWORD) t1->ifsc : remaining;
+    UCHAR pcb = (t1->ns ? T1_NS : 0) | ((*chunk < remaining) ? T1_MORE : 0);
+    return t1_build(t1, pcb, &apdu[offset], *chunk, block);
+}
+
+static size_t t1_build_r_block(const struct t1 *t1, int error, UCHAR *block) {
+    return t1_build(t1, T1_R_BLOCK | (t1->nr ? T1_NR : 0) | error, NULL, 0, block);
+}
+
+/* Reads one block. Returns IFD_COMMUNICATION_ERROR with *error set if the
+   block arrived damaged, so the caller can ask for a retransmission. */
+static RESPONSECODE t1_receive(struct reader *reader, UCHAR *block, int *error) {
+    *error = T1_OTHER_ERROR;
+    CHECK(readMessage(reader, 3, block, T1_BLOCK_SIZE));
+    if(block[2] > T1_MAX_INF) {
+        syslog(LOG_ERR, "T=1 block with invalid LEN %i", block[2]);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    size_t edc_length = reader->t1.crc ? 2 : 1;
+    CHECK(readMessage(reader, block[2] + edc_length, &block[3], T1_BLOCK_SIZE - 3));
+
+    UCHAR expected[2];
+    UCHAR copy[T1_BLOCK_SIZE];
+    memcpy(copy, block, 3 + block[2]);
+    t1_edc(&reader->t1, copy, 3 + block[2]);
+    memcpy(expected, &copy[3 + block[2]], edc_length);
+    // A WTX granted for this block is used up, the next one gets BWT again
+    if(block[1] != (T1_S_BLOCK | T1_S_WTX)) {
+        reader->t1.wtx = 0;
+    }
+    if(memcmp(expected, &block[3 + block[2]], edc_length)) {
+        syslog(LOG_ERR, "T=1 block with invalid EDC");
+        *error = T1_EDC_ERROR;
+        return IFD_COMMUNICATION_ERROR;
+    }
+    *error = 0;
+    return IFD_SUCCESS;
+}
+
+/* Sends an S-block request and waits for the matching response */
+static RESPONSECODE t1_s_request(struct reader *reader, UCHAR type, const UCHAR *inf, size_t length, UCHAR *reply) {
+    UCHAR block[T1_BLOCK_SIZE];
+    size_t block_length = t1_build(&reader->t1, T1_S_BLOCK | type, inf, length, block);
+    int attempt;
+    RESPONSECODE rv = IFD_COMMUNICATION_ERROR;
+    for(attempt = 0; attempt < T1_RETRIES; attempt++) {
+        int error;
+        CHECK(writeCommand(reader, block, block_length, 3));
+        rv = t1_receive(reader, reply, &error);
+        if(rv == IFD_NO_SUCH_DEVICE) {
+            return rv;
+        }
+        if(rv == IFD_SUCCESS && reply[1] == (T1_S_BLOCK | T1_S_RESPONSE | type)) {
+            return IFD_SUCCESS;
+        }
+        rv = IFD_COMMUNICATION_ERROR;
+    }
+    return rv;
+}
+
+static RESPONSECODE t1_resynch(struct reader *reader) {
+    struct t1 *t1 = &reader->t1;
+    UCHAR reply[T1_BLOCK_SIZE];
+    syslog(LOG_INFO, "T=1 resynchronization");
+    CHECK(t1_s_request(reader, T1_S_RESYNCH, NULL, 0, reply));
+    t1->ns = 0;
+    t1->nr = 0;
+    t1->ifsc = t1->initial_ifsc;
+    t1->ifsd = 32;
+    return IFD_SUCCESS;
+}
+
+/* Tells the card the largest block the driver accepts. On failure the card
+   keeps sending at most 32 bytes per block, which is not fatal. */
+RESPONSECODE t1_negotiate_ifsd(struct reader *reader, int ifsd) {
+    UCHAR inf = ifsd;
+    UCHAR reply[T1_BLOCK_SIZE];
+    RESPONSECODE rv = t1_s_request(reader, T1_S_IFS, &inf, 1, reply);
+    if(rv == IFD_SUCCESS && reply[2] == 1 && reply[3] == inf) {
+        reader->t1.ifsd = ifsd;
+    } else if(rv != IFD_NO_SUCH_DEVICE) {
+        syslog(LOG_INFO, "Card did not accept IFSD %i", ifsd);
+        rv = IFD_SUCCESS;
+    }
+    return rv;
+}
+
+/* Sends the APDU in one or more chained I-blocks and collects the chained
+   response, handling retransmissions, S-block requests from the card and,
+   as a last resort, a resynchronization. */
+RESPONSECODE t1_transceive(struct reader *reader, const UCHAR *apdu, DWORD apdu_length, PUCHAR response, PDWORD response_length) {
+    struct t1 *t1 = &reader->t1;
+    DWORD capacity = *response_length;
+    DWORD received = 0;
+    DWORD sent = 0;     // APDU bytes acknowledged by the card
+    size_t chunk;       // APDU bytes in the I-block being sent
+    int sending = 1;
+    int errors = 0;
+    int resynched = 0;
+    UCHAR block[T1_BLOCK_SIZE];
+    UCHAR reply[T1_BLOCK_SIZE];
+
+    *response_length = 0;
+    size_t block_length = t1_build_i_block(t1, apdu, apdu_length, sent, &chunk, block);
+
+    for(;;) {
+        int error;
+        CHECK(writeCommand(reader, block, block_length, 3));
+        RESPONSECODE rv = t1_receive(reader, reply, &error);
+        if(rv == IFD_NO_SUCH_DEVICE || rv == IFD_ERROR_INSUFFICIENT_BUFFER) {
+            return rv;
+        }
+
+        UCHAR pcb = reply[1];
+        if(rv == IFD_SUCCESS && IS_I_BLOCK(pcb)) {
+            if((sending && sent + chunk < apdu_length) || !!(pcb & T1_NS) != t1->nr) {
+                error = T1_OTHER_ERROR;
+            } else {
+                // The card's I-block acknowledges our last one
+                if(sending) {
+                    t1->ns ^= 1;
+                    sending = 0;
+                }
+                if(received + reply[2] > capacity) {
+                    syslog(LOG_ERR, "T=1 response exceeds buffer of %"PRIdword" bytes", capacity);
+                    return IFD_ERROR_INSUFFICIENT_BUFFER;
+                }
+                memcpy(&response[received], &reply[3], reply[2]);
+                received += reply[2];
+                t1->nr ^= 1;
+                errors = 0;
+                if(!(pcb & T1_MORE)) {
+                    *response_length = received;
+                    return IFD_SUCCESS;
+                }
+                block_length = t1_build_r_block(t1, 0, block);
+                continue;
+            }
+        } else if(rv == IFD_SUCCESS && IS_R_BLOCK(pcb)) {
+            if(sending && sent + chunk < apdu_length && !!(pcb & T1_NR) != t1->ns) {
+                // Acknowledges a chained I-block, send the next part
+                sent += chunk;
+                t1->ns ^= 1;
+                errors = 0;
+                block_length = t1_build_i_block(t1, apdu, apdu_length, sent, &chunk, block);
+                continue;
+            }
+            // Anything else asks for our last block again
+            error = -1;
+        } else if(rv == IFD_SUCCESS) {
+            UCHAR type = pcb & 0x1F;
+            if(pcb & T1_S_RESPONSE) {
+                error = T1_OTHER_ERROR;
+            } else if(type == T1_S_WTX && reply[2] == 1) {
+                t1->wtx = reply[3];
+                syslog(LOG_DEBUG, "T=1 waiting time extension x%i", t1->wtx);
+                block_length = t1_build(t1, T1_S_BLOCK | T1_S_RESPONSE | T1_S_WTX, &reply[3], 1, block);
+                continue;
+            } else if(type == T1_S_IFS && reply[2] == 1 && reply[3] >= 1 && reply[3] <= T1_MAX_INF) {
+                t1->ifsc = reply[3];
+                block_length = t1_build(t1, T1_S_BLOCK | T1_S_RESPONSE | T1_S_IFS, &reply[3], 1, block);
+                continue;
+            } else if(type == T1_S_ABORT) {
+                block_length = t1_build(t1, T1_S_BLOCK | T1_S_RESPONSE | T1_S_ABORT, NULL, 0, block);
+                CHECK(writeMessage(reader, block, block_length));
+                syslog(LOG_ERR, "T=1 chain aborted by card");
+                return IFD_COMMUNICATION_ERROR;
+            } else {
+                error = T1_OTHER_ERROR;
+            }
+        }
+
+        if(++errors > T1_RETRIES) {
+            if(resynched) {
+                return IFD_COMMUNICATION_ERROR;
+            }
+            CHECK(t1_resynch(reader));
+            resynched = 1;
+            errors = 0;
+            sent = 0;
+            received = 0;
+            sending = 1;
+            block_length = t1_build_i_block(t1, apdu, apdu_length, sent, &chunk, block);
+        } else if(error > 0) {
+            block_length = t1_build_r_block(t1, error, block);
+        }
+        // error < 0: retransmit block unchanged
+    }
+}
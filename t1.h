@@ -0,0 +1,38 @@
+/*****************************************************************
+/
+/ File   :   t1.h
+/ Date   :   October 16, 2026
+/ Purpose:   ISO 7816-3 T=1 block transmission protocol.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _t1_h_
+#define _t1_h_
+
+#include "ifdhandler.h"
+#include "atr.h"
+
+#define T1_MAX_INF 254
+#define T1_BLOCK_SIZE (3 + T1_MAX_INF + 2) /* prologue, INF and CRC */
+#define T1_IFSD 254 /* largest block the driver accepts from the card */
+
+/* Per-card T=1 state, reset on every ATR */
+struct t1 {
+    UCHAR nad;
+    int ns;             /* N(S) of the next I-block we send */
+    int nr;             /* N(S) expected in the next I-block from the card */
+    int ifsc;           /* largest INF the card accepts */
+    int ifsd;           /* largest INF we accept, as told to the card */
+    int initial_ifsc;
+    int crc;            /* EDC is CRC instead of LRC */
+    UCHAR wtx;          /* BWT multiplier requested for the next block, 0 if none */
+};
+
+struct reader;
+
+void t1_init(struct t1 *t1, const struct atr *atr);
+RESPONSECODE t1_negotiate_ifsd(struct reader *reader, int ifsd);
+RESPONSECODE t1_transceive(struct reader *reader, const UCHAR *apdu, DWORD apdu_length, PUCHAR response, PDWORD response_length);
+
+#endif
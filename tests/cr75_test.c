@@ -0,0 +1,588 @@
+/*****************************************************************
+/
+/ File   :   cr75_test.c
+/ Date   :   October 16, 2026
+/ Purpose:   Runs the driver through its IFDH entry points against the
+/            emulator transport. Each case is registered with ctest,
+/            cr75_test <case> runs one and no argument runs them all.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "../reader.h"
+#include "../cr75.h"
+#include "../emulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LUN 0
+
+/* 3B 80 81 31 20 45: T=1 with IFSC 32, BWI 4, CWI 5 and LRC */
+static const UCHAR t1_atr[] = { 0x3B, 0x80, 0x81, 0x31, 0x20, 0x45, 0x55 };
+/* Same with TC3 selecting CRC */
+static const UCHAR t1_crc_atr[] = { 0x3B, 0x80, 0x81, 0x71, 0x20, 0x45, 0x01, 0x14 };
+
+static int failures;
+
+#define EXPECT(x) do { \
+    if(!(x)) { \
+        fprintf(stderr, "%s:%i: %s\n", __FILE__, __LINE__, #x); \
+        failures++; \
+    } \
+} while (0)
+
+static void set_emulator(const char *name, const char *value) {
+    if(value) {
+        setenv(name, value, 1);
+    } else {
+        unsetenv(name);
+    }
+}
+
+/* Opens the emulated reader with the card configured by the CR75_EMULATOR_*
+   variables and powers the card up */
+static RESPONSECODE open_reader(void) {
+    setenv("CR75_EMULATOR", "1", 1);
+    RESPONSECODE rv = IFDHCreateChannel(LUN, 0);
+    if(rv != IFD_SUCCESS || IFDHICCPresence(LUN) != IFD_ICC_PRESENT) {
+        return rv;
+    }
+    UCHAR atr[MAX_ATR_SIZE];
+    DWORD atr_length = sizeof(atr);
+    return IFDHPowerICC(LUN, IFD_POWER_UP, atr, &atr_length);
+}
+
+static void close_reader(void) {
+    IFDHCloseChannel(LUN);
+    unsetenv("CR75_EMULATOR_ATR");
+    unsetenv("CR75_EMULATOR_NULLS");
+    unsetenv("CR75_EMULATOR_BYTEWISE");
+    unsetenv("CR75_EMULATOR_PPS_REJECT");
+    unsetenv("CR75_ASYNC_DEPTH");
+}
+
+static RESPONSECODE transmit(const UCHAR *apdu, DWORD length, PUCHAR response, PDWORD response_length) {
+    SCARD_IO_HEADER pci = { 0, 0 };
+    return IFDHTransmitToICC(LUN, pci, (PUCHAR) apdu, length, response, response_length, NULL);
+}
+
+static void get_metrics(struct cr75_metrics *metrics) {
+    DWORD length = 0;
+    memset(metrics, 0, sizeof(*metrics));
+    IFDHControl(LUN, IOCTL_CR75_METRICS, NULL, 0, (PUCHAR) metrics, sizeof(*metrics), &length);
+}
+
+static int ends_with_sw(const UCHAR *response, DWORD length, unsigned int sw) {
+    return length >= 2 && response[length - 2] == (sw >> 8) && response[length - 1] == (sw & 0xFF);
+}
+
+/* The same exchanges for any card: every ISO case and command and response
+   data beyond one T=1 block. T=0 maps an extended Le onto P3 = 00, the
+   emulated card then answers with the first 256 bytes. */
+static void exchange_apdus(void) {
+    int t1 = readers[0].protocol == 1;
+    UCHAR response[1024];
+    DWORD length;
+    int i;
+
+    UCHAR select[] = { 0x00, 0xA4, 0x04, 0x00, 0x02, 0x3F, 0x00, 0x00 };
+    length = sizeof(response);
+    EXPECT(transmit(select, sizeof(select), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 22 && response[0] == 0x6F && ends_with_sw(response, length, 0x9000));
+
+    UCHAR update[5 + 200];
+    memcpy(update, "\x00\xD6\x00\x00\xC8", 5);
+    for(i = 0; i < 200; i++) {
+        update[5 + i] = i;
+    }
+    length = sizeof(response);
+    EXPECT(transmit(update, sizeof(update), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 2 && ends_with_sw(response, length, 0x9000));
+
+    UCHAR read[] = { 0x00, 0xB0, 0x00, 0x00, 0xC8 };
+    length = sizeof(response);
+    EXPECT(transmit(read, sizeof(read), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 202 && !memcmp(response, &update[5], 200) && ends_with_sw(response, length, 0x9000));
+
+    UCHAR get_data[] = { 0x00, 0xCA, 0x00, 0x00, 0x00 };
+    length = sizeof(response);
+    EXPECT(transmit(get_data, sizeof(get_data), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 10 && response[0] == 0xC0 && ends_with_sw(response, length, 0x9000));
+
+    UCHAR read_extended[] = { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x02, 0x00 };
+    length = sizeof(response);
+    EXPECT(transmit(read_extended, sizeof(read_extended), response, &length) == IFD_SUCCESS);
+    EXPECT(length == (t1 ? 514 : 258) && !memcmp(response, &update[5], 200) && ends_with_sw(response, length, 0x9000));
+
+    UCHAR unknown[] = { 0x00, 0x01, 0x00, 0x00 };
+    length = sizeof(response);
+    EXPECT(transmit(unknown, sizeof(unknown), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 2 && ends_with_sw(response, length, 0x6D00));
+}
+
+static void test_atr(void) {
+    struct atr atr;
+    UCHAR t0_atr[] = { 0x3B, 0x14, 0x96, 'C', 'R', '7', '5' };
+    EXPECT(atr_parse(t0_atr, sizeof(t0_atr), &atr) == 0);
+    EXPECT(atr.has_ta1 && atr.fidi == 0x96 && atr.protocol == 0);
+    EXPECT(atr.historical_length == 4);
+
+    EXPECT(atr_parse(t1_atr, sizeof(t1_atr), &atr) == 0);
+    EXPECT(!atr.has_ta1 && atr.protocol == 1 && (atr.protocols & ATR_PROTOCOL(1)));
+    EXPECT(atr.ifsc == 0x20 && atr.bwi == 4 && atr.cwi == 5 && !atr.crc);
+    EXPECT(atr_parse(t1_crc_atr, sizeof(t1_crc_atr), &atr) == 0 && atr.crc);
+
+    UCHAR damaged[sizeof(t1_atr)];
+    memcpy(damaged, t1_atr, sizeof(t1_atr));
+    damaged[sizeof(damaged) - 1] ^= 0x01;
+    EXPECT(atr_parse(damaged, sizeof(damaged), &atr) != 0);
+    EXPECT(atr_parse(t1_atr, sizeof(t1_atr) - 1, &atr) != 0);
+    EXPECT(atr_parse(t0_atr, 1, &atr) != 0);
+}
+
+static void test_apdu(void) {
+    struct apdu apdu;
+    UCHAR buffer[4 + 3 + 65535 + 2];
+
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xA4\x04", 3, &apdu) == 0);
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xA4\x04\x00", 4, &apdu) == 1);
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xB0\x00\x00\x00", 5, &apdu) == 2 && apdu.Le == 256 && !apdu.extended);
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xD6\x00\x00\x01\xAA", 6, &apdu) == 3 && apdu.Lc == 1 && apdu.data[0] == 0xAA);
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xA4\x04\x00\x01\xAA\x10", 7, &apdu) == 4 && apdu.Lc == 1 && apdu.Le == 16);
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xD6\x00\x00\x02\xAA", 6, &apdu) == 0 && !apdu.data);
+
+    // B1 = 00 with fewer than 3 length bytes behind the header
+    UCHAR short_extended[6] = { 0x00, 0xA4, 0x04, 0x00, 0x00, 0x00 };
+    EXPECT(parse_apdu(short_extended, sizeof(short_extended), &apdu) == 0);
+    short_extended[5] = 0x01;
+    EXPECT(parse_apdu(short_extended, sizeof(short_extended), &apdu) == 0);
+
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xB0\x00\x00\x00\x00\x00", 7, &apdu) == 2 && apdu.extended && apdu.Le == 65536);
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xB0\x00\x00\x00\x01\x2C", 7, &apdu) == 2 && apdu.Le == 300);
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xD6\x00\x00\x00\x00\x00\xAA", 8, &apdu) == 0);
+    EXPECT(parse_apdu((const UCHAR *) "\x00\xD6\x00\x00\x00\x00\x02\xAA", 8, &apdu) == 0);
+
+    memset(buffer, 0x55, sizeof(buffer));
+    memcpy(buffer, "\x00\xD6\x00\x00\x00\xFF\xFF", 7);
+    EXPECT(parse_apdu(buffer, 7 + 65535, &apdu) == 3 && apdu.Lc == 65535 && apdu.data == &buffer[7]);
+    buffer[7 + 65535] = 0x00;
+    buffer[7 + 65536] = 0x00;
+    EXPECT(parse_apdu(buffer, 7 + 65535 + 2, &apdu) == 4 && apdu.Lc == 65535 && apdu.Le == 65536);
+    EXPECT(parse_apdu(buffer, 7 + 65535 + 1, &apdu) == 0);
+}
+
+/* Emulator transport whose bulk IN ends with a zero-length packet after
+   empty_after more bytes, or times out if timeout_in is set, and that
+   counts the bulk INs armed ahead */
+static struct transport test_transport;
+static const struct transport *inner_transport;
+static int empty_after;
+static int timeout_in;
+static int armed_ins;
+static int async_writes;
+
+static int short_bulk(struct reader *reader, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+    if(endpoint == 0x86 && empty_after >= 0) {
+        if(!empty_after) {
+            *transferred = 0;
+            return 0;
+        }
+        if(length > empty_after) {
+            length = empty_after;
+        }
+        int err = inner_transport->bulk(reader, endpoint, data, length, transferred, timeout);
+        empty_after -= *transferred;
+        return err;
+    }
+    if(endpoint == 0x86 && timeout_in) {
+        *transferred = 0;
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    return inner_transport->bulk(reader, endpoint, data, length, transferred, timeout);
+}
+
+static int counting_arm_in(struct reader *reader, unsigned char *data, int length, unsigned int timeout) {
+    if(data) {
+        armed_ins++;
+    }
+    return inner_transport->arm_in(reader, data, length, timeout);
+}
+
+static RESPONSECODE counting_write_async(struct reader *reader, PUCHAR msg, size_t length, unsigned int timeout) {
+    async_writes++;
+    return inner_transport->write_async(reader, msg, length, timeout);
+}
+
+static void wrap_transport(void) {
+    inner_transport = readers[0].transport;
+    test_transport = *inner_transport;
+    test_transport.bulk = short_bulk;
+    test_transport.arm_in = counting_arm_in;
+    test_transport.write_async = counting_write_async;
+    readers[0].transport = &test_transport;
+    empty_after = -1;
+    timeout_in = 0;
+    armed_ins = 0;
+    async_writes = 0;
+}
+
+static void unwrap_transport(void) {
+    readers[0].transport = inner_transport;
+}
+
+static void test_short_atr(void) {
+    UCHAR atr[MAX_ATR_SIZE];
+    DWORD atr_length;
+
+    setenv("CR75_EMULATOR", "1", 1);
+    EXPECT(IFDHCreateChannel(LUN, 0) == IFD_SUCCESS);
+    wrap_transport();
+
+    empty_after = 0;
+    atr_length = sizeof(atr);
+    EXPECT(IFDHPowerICC(LUN, IFD_POWER_UP, atr, &atr_length) == IFD_COMMUNICATION_ERROR);
+    empty_after = 3;
+    atr_length = sizeof(atr);
+    EXPECT(IFDHPowerICC(LUN, IFD_POWER_UP, atr, &atr_length) == IFD_COMMUNICATION_ERROR);
+    atr_length = sizeof(atr);
+    EXPECT(IFDHGetCapabilities(LUN, TAG_IFD_ATR, &atr_length, atr) == IFD_SUCCESS && atr_length == 0);
+
+    empty_after = -1;
+    atr_length = sizeof(atr);
+    EXPECT(IFDHPowerICC(LUN, IFD_POWER_UP, atr, &atr_length) == IFD_SUCCESS && atr_length == 7);
+
+    unwrap_transport();
+    close_reader();
+}
+
+/* Responses read through a bulk IN submitted along with the command */
+static void test_armed(void) {
+    set_emulator("CR75_ASYNC_DEPTH", "4");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    wrap_transport();
+    exchange_apdus();
+    EXPECT(armed_ins > 0);
+    unwrap_transport();
+    close_reader();
+
+    set_emulator("CR75_ASYNC_DEPTH", "4");
+    set_emulator("CR75_EMULATOR_ATR", "3B 80 81 31 20 45 55");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    wrap_transport();
+    exchange_apdus();
+    EXPECT(armed_ins > 0);
+    unwrap_transport();
+    close_reader();
+
+    set_emulator("CR75_ASYNC_DEPTH", "0");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    wrap_transport();
+    exchange_apdus();
+    EXPECT(armed_ins == 0);
+    unwrap_transport();
+    close_reader();
+}
+
+/* Keeps the command data of every UPDATE BINARY */
+static UCHAR updated[256];
+static size_t updated_length;
+
+static unsigned int recording_apdu(void *context, const uint8_t *header, const uint8_t *data, size_t lc, unsigned int ne, uint8_t *response, size_t *length) {
+    *length = 0;
+    if(header[1] == 0xD6 && data) {
+        memcpy(updated, data, lc);
+        updated_length = lc;
+    }
+    return 0x9000;
+}
+
+/* Commands longer than one bulk chunk go out with several chunks in flight */
+static void test_async_write(void) {
+    UCHAR response[300];
+    DWORD length;
+    UCHAR update[5 + 255] = { 0x00, 0xD6, 0x00, 0x00, 0xFF };
+    int i;
+    for(i = 0; i < 255; i++) {
+        update[5 + i] = i ^ 0x5A;
+    }
+
+    set_emulator("CR75_ASYNC_DEPTH", "2");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    emulator_transport_emulator(&readers[0])->config.apdu = recording_apdu;
+    wrap_transport();
+    length = sizeof(response);
+    EXPECT(transmit(update, sizeof(update), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 2 && ends_with_sw(response, length, 0x9000));
+    EXPECT(async_writes > 0);
+    EXPECT(updated_length == 255 && !memcmp(updated, &update[5], 255));
+    unwrap_transport();
+    close_reader();
+
+    // T=1 sends the whole block at once
+    set_emulator("CR75_ASYNC_DEPTH", "2");
+    set_emulator("CR75_EMULATOR_ATR", "3B 80 81 31 20 45 55");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    emulator_transport_emulator(&readers[0])->config.apdu = recording_apdu;
+    wrap_transport();
+    updated_length = 0;
+    length = sizeof(response);
+    EXPECT(transmit(update, sizeof(update), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 2 && ends_with_sw(response, length, 0x9000));
+    EXPECT(async_writes > 0);
+    EXPECT(updated_length == 255 && !memcmp(updated, &update[5], 255));
+    unwrap_transport();
+    close_reader();
+}
+
+static void test_t0(void) {
+    EXPECT(open_reader() == IFD_SUCCESS);
+    EXPECT(readers[0].protocol == 0);
+    exchange_apdus();
+    close_reader();
+
+    // NULL procedure bytes before every procedure byte and status
+    set_emulator("CR75_EMULATOR_NULLS", "2");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    exchange_apdus();
+    close_reader();
+
+    // Data asked for and sent byte by byte with INS complements
+    set_emulator("CR75_EMULATOR_BYTEWISE", "1");
+    set_emulator("CR75_EMULATOR_NULLS", "1");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    exchange_apdus();
+    close_reader();
+}
+
+/* Announces data with 61 10 that GET RESPONSE never delivers */
+static unsigned int endless_apdu(void *context, const uint8_t *header, const uint8_t *data, size_t lc, unsigned int ne, uint8_t *response, size_t *length) {
+    *length = 0;
+    return (header[1] == 0xCA || header[1] == 0xC0) ? 0x6110 : 0x9000;
+}
+
+static void test_get_response(void) {
+    UCHAR response[300];
+    DWORD length;
+    UCHAR get_data[] = { 0x00, 0xCA, 0x00, 0x00, 0x00 };
+    UCHAR select[] = { 0x00, 0xA4, 0x04, 0x00, 0x02, 0x3F, 0x00 };
+
+    EXPECT(open_reader() == IFD_SUCCESS);
+    struct emulator *emulator = emulator_transport_emulator(&readers[0]);
+    EXPECT(emulator != NULL);
+    emulator->config.apdu = endless_apdu;
+
+    length = sizeof(response);
+    EXPECT(transmit(get_data, sizeof(get_data), response, &length) == IFD_COMMUNICATION_ERROR);
+    EXPECT(length == 0);
+    length = sizeof(response);
+    EXPECT(transmit(select, sizeof(select), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 2 && ends_with_sw(response, length, 0x9000));
+
+    // Without TAG_CR75_T0_GET_RESPONSE the application sees the 61xx
+    UCHAR value = 0;
+    EXPECT(IFDHSetCapabilities(LUN, TAG_CR75_T0_GET_RESPONSE, 1, &value) == IFD_SUCCESS);
+    length = sizeof(response);
+    EXPECT(transmit(get_data, sizeof(get_data), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 2 && ends_with_sw(response, length, 0x6110));
+    close_reader();
+}
+
+static void test_combined(void) {
+    UCHAR response[300];
+    DWORD length;
+    UCHAR value;
+    int i;
+    UCHAR update[5 + 32] = { 0x00, 0xD6, 0x00, 0x00, 0x20 };
+    for(i = 0; i < 32; i++) {
+        update[5 + i] = 0xA0 + i;
+    }
+    // Past the end of the file, the card refuses it on the header
+    UCHAR overflow[5 + 32] = { 0x00, 0xD6, 0x7F, 0xF0, 0x20 };
+    UCHAR read[] = { 0x00, 0xB0, 0x00, 0x00, 0x20 };
+
+    EXPECT(open_reader() == IFD_SUCCESS);
+    length = sizeof(value);
+    EXPECT(IFDHGetCapabilities(LUN, TAG_CR75_T0_COMBINED, &length, &value) == IFD_SUCCESS && value == 0);
+    length = sizeof(response);
+    EXPECT(transmit(update, sizeof(update), response, &length) == IFD_SUCCESS);
+    length = sizeof(response);
+    EXPECT(transmit(overflow, sizeof(overflow), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 2 && ends_with_sw(response, length, 0x6B00));
+    length = sizeof(response);
+    EXPECT(transmit(read, sizeof(read), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 34 && !memcmp(response, &update[5], 32));
+
+    // Data sent along with the header of a refused command is lost
+    value = 1;
+    EXPECT(IFDHSetCapabilities(LUN, TAG_CR75_T0_COMBINED, 1, &value) == IFD_SUCCESS);
+    length = sizeof(response);
+    EXPECT(transmit(update, sizeof(update), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 2 && ends_with_sw(response, length, 0x9000));
+    length = sizeof(response);
+    EXPECT(transmit(overflow, sizeof(overflow), response, &length) == IFD_COMMUNICATION_ERROR);
+    EXPECT(length == 0);
+
+    // The firmware may wait for the third byte instead of passing on the
+    // SW1 SW2 of a refusal, the INS is not ACKed any longer either way
+    length = sizeof(response);
+    EXPECT(IFDHPowerICC(LUN, IFD_RESET, response, &length) == IFD_SUCCESS);
+    length = sizeof(response);
+    EXPECT(transmit(update, sizeof(update), response, &length) == IFD_SUCCESS);
+    wrap_transport();
+    timeout_in = 1;
+    length = sizeof(response);
+    EXPECT(transmit(overflow, sizeof(overflow), response, &length) != IFD_SUCCESS);
+    EXPECT(!(readers[0].t0_acked[0xD6 >> 3] & (1 << (0xD6 & 7))));
+    unwrap_transport();
+
+    length = sizeof(response);
+    EXPECT(IFDHPowerICC(LUN, IFD_RESET, response, &length) == IFD_SUCCESS);
+    update[5] = 0x5A;
+    length = sizeof(response);
+    EXPECT(transmit(update, sizeof(update), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 2 && ends_with_sw(response, length, 0x9000));
+    length = sizeof(response);
+    EXPECT(transmit(read, sizeof(read), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 34 && !memcmp(response, &update[5], 32));
+    close_reader();
+}
+
+static void test_t1(void) {
+    set_emulator("CR75_EMULATOR_ATR", "3B 80 81 31 20 45 55");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    EXPECT(readers[0].protocol == 1);
+    EXPECT(readers[0].t1.ifsc == 32 && readers[0].t1.ifsd == T1_IFSD);
+    exchange_apdus();
+    close_reader();
+
+    set_emulator("CR75_EMULATOR_ATR", "3B 80 81 71 20 45 01 14");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    EXPECT(readers[0].protocol == 1 && readers[0].t1.crc);
+    exchange_apdus();
+    close_reader();
+}
+
+static void test_pps(void) {
+    struct cr75_metrics metrics;
+
+    // TA1 96: the card runs at the rate negotiated with PPS
+    EXPECT(open_reader() == IFD_SUCCESS);
+    get_metrics(&metrics);
+    EXPECT(metrics.pps_exchanges == 1 && metrics.pps_failures == 0);
+    EXPECT(readers[0].fidi == 0x13);
+    exchange_apdus();
+    close_reader();
+
+    // Without TA1 the card stays at Fd/Dd, no PPS is needed
+    set_emulator("CR75_EMULATOR_ATR", "3B 04 43 52 37 35");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    get_metrics(&metrics);
+    EXPECT(metrics.pps_exchanges == 0);
+    EXPECT(readers[0].fidi == 0x11);
+    exchange_apdus();
+    close_reader();
+
+    // TA1 of a card faster than the reader is known to go: F = 512, D = 64
+    set_emulator("CR75_EMULATOR_ATR", "3B 14 97 43 52 37 35");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    EXPECT(readers[0].fidi == 0x13);
+    close_reader();
+
+    // TA2: the card runs at TA1 after the ATR, and keeps doing so when
+    // asked for a protocol it does not run
+    set_emulator("CR75_EMULATOR_ATR", "3B 94 13 10 00 43 52 37 35");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    get_metrics(&metrics);
+    EXPECT(metrics.pps_exchanges == 0);
+    EXPECT(readers[0].fidi == 0x13);
+    EXPECT(IFDHSetProtocolParameters(LUN, SCARD_PROTOCOL_T1, 0, 0, 0, 0) == IFD_PROTOCOL_NOT_SUPPORTED);
+    EXPECT(readers[0].fidi == 0x13);
+    exchange_apdus();
+    close_reader();
+
+    // A refused PPS leaves card and reader at the default rate
+    set_emulator("CR75_EMULATOR_PPS_REJECT", "1");
+    EXPECT(open_reader() == IFD_SUCCESS);
+    get_metrics(&metrics);
+    EXPECT(metrics.pps_exchanges == 1 && metrics.pps_failures == 1);
+    EXPECT(readers[0].fidi == 0x11);
+    exchange_apdus();
+    close_reader();
+}
+
+static void test_removal(void) {
+    UCHAR response[300];
+    DWORD length;
+    UCHAR value;
+    UCHAR read[] = { 0x00, 0xB0, 0x00, 0x00, 0x10 };
+
+    EXPECT(open_reader() == IFD_SUCCESS);
+    value = 0;
+    EXPECT(IFDHSetCapabilities(LUN, TAG_CR75_EMULATOR_CARD, 1, &value) == IFD_SUCCESS);
+    EXPECT(IFDHICCPresence(LUN) == IFD_ICC_NOT_PRESENT);
+    length = sizeof(response);
+    EXPECT(transmit(read, sizeof(read), response, &length) == IFD_ICC_NOT_PRESENT);
+    EXPECT(length == 0);
+    length = sizeof(response);
+    EXPECT(IFDHGetCapabilities(LUN, TAG_IFD_ATR, &length, response) == IFD_SUCCESS && length == 0);
+
+    // A card inserted in its place is not powered up
+    value = 1;
+    EXPECT(IFDHSetCapabilities(LUN, TAG_CR75_EMULATOR_CARD, 1, &value) == IFD_SUCCESS);
+    EXPECT(IFDHICCPresence(LUN) == IFD_ICC_PRESENT);
+    length = sizeof(response);
+    EXPECT(IFDHGetCapabilities(LUN, TAG_IFD_ATR, &length, response) == IFD_SUCCESS && length == 0);
+    length = sizeof(response);
+    EXPECT(transmit(read, sizeof(read), response, &length) == IFD_ICC_NOT_PRESENT);
+    EXPECT(length == 0);
+    length = sizeof(response);
+    EXPECT(IFDHPowerICC(LUN, IFD_RESET, response, &length) == IFD_SUCCESS && length == 7);
+    length = sizeof(response);
+    EXPECT(transmit(read, sizeof(read), response, &length) == IFD_SUCCESS);
+
+    value = 0;
+    EXPECT(IFDHSetCapabilities(LUN, TAG_CR75_EMULATOR_CARD, 1, &value) == IFD_SUCCESS);
+    value = 1;
+    EXPECT(IFDHSetCapabilities(LUN, TAG_CR75_EMULATOR_CARD, 1, &value) == IFD_SUCCESS);
+    EXPECT(IFDHICCPresence(LUN) == IFD_ICC_PRESENT);
+    length = sizeof(response);
+    EXPECT(IFDHPowerICC(LUN, IFD_POWER_UP, response, &length) == IFD_SUCCESS && length == 7);
+    length = sizeof(response);
+    EXPECT(transmit(read, sizeof(read), response, &length) == IFD_SUCCESS);
+    EXPECT(length == 18 && ends_with_sw(response, length, 0x9000));
+    close_reader();
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    { "atr", test_atr },
+    { "apdu", test_apdu },
+    { "short_atr", test_short_atr },
+    { "armed", test_armed },
+    { "async_write", test_async_write },
+    { "t0", test_t0 },
+    { "get_response", test_get_response },
+    { "combined", test_combined },
+    { "t1", test_t1 },
+    { "pps", test_pps },
+    { "removal", test_removal },
+};
+
+int main(int argc, char **argv) {
+    size_t i;
+    int found = 0;
+    for(i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        if(argc < 2 || !strcmp(argv[1], tests[i].name)) {
+            tests[i].run();
+            found = 1;
+        }
+    }
+    if(!found) {
+        fprintf(stderr, "Unknown test %s\n", argv[1]);
+        return 2;
+    }
+    return failures ? 1 : 0;
+}
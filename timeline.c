@@ -0,0 +1,144 @@
+/*****************************************************************
+/
+/ File   :   timeline.c
+/ Date   :   October 16, 2026
+/ Purpose:   Spans of entry points and USB transfers, exported as a
+/            Chrome trace event / Perfetto JSON file.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "reader.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define TIMELINE_MAX_SPANS 262144 /* about 10 MB, later spans are dropped */
+#define TIMELINE_READERS 64 /* tracks named with process_name metadata */
+
+struct span {
+    const char *name;
+    const char *arg_name;
+    long arg;
+    uint64_t start;
+    uint64_t end;
+    int reader;
+    int thread;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t thread_key;
+    int enabled;
+    char *path;
+    int started;        /* the file has been created */
+    struct span *spans;
+    size_t count;
+    unsigned long dropped;
+    int threads;        /* thread numbers handed out so far */
+    uint64_t named;     /* readers with a process_name event in the file */
+} timeline = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT, 0, 0, NULL, 0, NULL, 0, 0, 0, 0 };
+
+static void timeline_setup(void) {
+    const char *path = getenv("CR75_TIMELINE");
+    if(!path || !*path) {
+        return;
+    }
+    timeline.path = strdup(path);
+    timeline.spans = malloc(TIMELINE_MAX_SPANS * sizeof(struct span));
+    if(!timeline.path || !timeline.spans || pthread_key_create(&timeline.thread_key, NULL)) {
+        syslog(LOG_ERR, "Timeline disabled, out of memory");
+        return;
+    }
+    syslog(LOG_INFO, "Recording timeline to %s", timeline.path);
+    __atomic_store_n(&timeline.enabled, 1, __ATOMIC_RELEASE);
+}
+
+void timeline_init(void) {
+    pthread_once(&timeline.once, timeline_setup);
+}
+
+uint64_t timeline_begin(void) {
+    if(!__atomic_load_n(&timeline.enabled, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    return metrics_now();
+}
+
+/* Small per-thread numbers read better as tids than pthread_t values */
+static int thread_number(void) {
+    intptr_t number = (intptr_t) pthread_getspecific(timeline.thread_key);
+    if(!number) {
+        number = ++timeline.threads;
+        pthread_setspecific(timeline.thread_key, (void *) number);
+    }
+    return number;
+}
+
+void timeline_end(const char *name, int reader, uint64_t start, const char *arg_name, long arg) {
+    if(!start) {
+        return;
+    }
+    uint64_t end = metrics_now();
+    pthread_mutex_lock(&timeline.lock);
+    if(timeline.count < TIMELINE_MAX_SPANS) {
+        struct span *span = &timeline.spans[timeline.count++];
+        span->name = name;
+        span->arg_name = arg_name;
+        span->arg = arg;
+        span->start = start;
+        span->end = end;
+        span->reader = reader;
+        span->thread = thread_number();
+    } else {
+        timeline.dropped++;
+    }
+    pthread_mutex_unlock(&timeline.lock);
+}
+
+/* Events are written as a JSON array without the closing bracket, which
+   both viewers accept, so later flushes can simply append to the file. */
+void timeline_flush(void) {
+    if(!__atomic_load_n(&timeline.enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&timeline.lock);
+    FILE *file = fopen(timeline.path, timeline.started ? "a" : "w");
+    if(!file) {
+        syslog(LOG_ERR, "Cannot write timeline to %s", timeline.path);
+        pthread_mutex_unlock(&timeline.lock);
+        return;
+    }
+    if(!timeline.started) {
+        fputs("[\n", file);
+        timeline.started = 1;
+    }
+
+    size_t i;
+    for(i = 0; i < timeline.count; i++) {
+        const struct span *span = &timeline.spans[i];
+        if(span->reader >= 0 && span->reader < TIMELINE_READERS && !(timeline.named & (1ULL << span->reader))) {
+            fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%i,\"args\":{\"name\":\"CR-75 reader %i\"}},\n", span->reader, span->reader);
+            timeline.named |= 1ULL << span->reader;
+        }
+        fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%i,\"tid\":%i,\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+                span->name, span->reader, span->thread,
+                (unsigned long long) (span->start / 1000), (unsigned int) (span->start % 1000),
+                (unsigned long long) ((span->end - span->start) / 1000), (unsigned int) ((span->end - span->start) % 1000));
+        if(span->arg_name) {
+            fprintf(file, ",\"args\":{\"%s\":%ld}", span->arg_name, span->arg);
+        }
+        fputs("},\n", file);
+    }
+    if(timeline.dropped) {
+        syslog(LOG_WARNING, "Timeline full, dropped %lu spans", timeline.dropped);
+    }
+    timeline.count = 0;
+    timeline.dropped = 0;
+    fclose(file);
+    pthread_mutex_unlock(&timeline.lock);
+}
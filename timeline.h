@@ -0,0 +1,30 @@
+/*****************************************************************
+/
+/ File   :   timeline.h
+/ Date   :   October 16, 2026
+/ Purpose:   Spans of entry points and USB transfers, exported as a
+/            Chrome trace event / Perfetto JSON file.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _timeline_h_
+#define _timeline_h_
+
+#include <stdint.h>
+
+/* Set from the CR75_TIMELINE environment variable, the file spans are
+   flushed to on IFDHCloseChannel. Spans are only recorded when set. */
+void timeline_init(void);
+
+/* Start time for timeline_end(), 0 when the timeline is off */
+uint64_t timeline_begin(void);
+
+/* Records a complete span of name on the track of reader. name and
+   arg_name must be string literals, arg_name may be NULL. */
+void timeline_end(const char *name, int reader, uint64_t start, const char *arg_name, long arg);
+
+/* Appends the recorded spans to the file and forgets them */
+void timeline_flush(void);
+
+#endif
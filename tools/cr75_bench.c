@@ -0,0 +1,381 @@
+/*****************************************************************
+/
+/ File   :   cr75_bench.c
+/ Date   :   October 16, 2026
+/ Purpose:   Loads the driver through its IFDH entry points, as pcscd
+/            does, and measures throughput and latency of a standard
+/            workload mix.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "../ifdhandler.h"
+#include "../cr75.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CR75_DRIVER
+#define CR75_DRIVER "./libcr75.so"
+#endif
+
+#define MAX_READERS 16
+#define MAX_APDU 261
+
+static struct {
+    RESPONSECODE (*create_channel)(DWORD, DWORD);
+    RESPONSECODE (*close_channel)(DWORD);
+    RESPONSECODE (*power_icc)(DWORD, DWORD, PUCHAR, PDWORD);
+    RESPONSECODE (*transmit_to_icc)(DWORD, SCARD_IO_HEADER, PUCHAR, DWORD, PUCHAR, PDWORD, PSCARD_IO_HEADER);
+    RESPONSECODE (*icc_presence)(DWORD);
+    RESPONSECODE (*control)(DWORD, DWORD, PUCHAR, DWORD, PUCHAR, DWORD, PDWORD);
+} ifdh;
+
+/* The APDU mix: cases 1 to 4 with short and long data. The commands are
+   those of the emulator's built-in application, which any ISO 7816-4
+   file system card understands too. */
+struct apdu {
+    UCHAR bytes[MAX_APDU];
+    DWORD length;
+};
+
+static struct apdu mix[16];
+static size_t mix_length;
+
+static void add_apdu(UCHAR ins, UCHAR p1, int lc, int le) {
+    struct apdu *apdu = &mix[mix_length++];
+    UCHAR header[] = { 0x00, ins, p1, 0x00 };
+    memcpy(apdu->bytes, header, sizeof(header));
+    apdu->length = sizeof(header);
+    if(lc > 0) {
+        apdu->bytes[apdu->length++] = lc;
+        memset(&apdu->bytes[apdu->length], 0x3F, lc);
+        apdu->length += lc;
+    }
+    if(le >= 0) {
+        apdu->bytes[apdu->length++] = le;
+    }
+}
+
+static void build_mix(void) {
+    add_apdu(0xC2, 0x00, 0, -1);   // case 1
+    add_apdu(0xB0, 0x00, 0, 1);    // case 2
+    add_apdu(0xB0, 0x00, 0, 16);
+    add_apdu(0xB0, 0x00, 0, 128);
+    add_apdu(0xB0, 0x00, 0, 0);    // Le = 256
+    add_apdu(0xD6, 0x00, 1, -1);   // case 3
+    add_apdu(0xD6, 0x00, 16, -1);
+    add_apdu(0xD6, 0x00, 128, -1);
+    add_apdu(0xD6, 0x00, 255, -1);
+    add_apdu(0xA4, 0x04, 2, 0);    // case 4
+    add_apdu(0xA4, 0x04, 16, 0);
+}
+
+struct samples {
+    uint64_t *ns;
+    size_t count;
+};
+
+struct worker {
+    pthread_t thread;
+    DWORD lun;
+    int iterations;
+    struct samples samples;
+    unsigned long errors;
+    volatile int stop;
+};
+
+struct workload {
+    const char *name;
+    void *(*run)(void *);
+    int divisor;        /* of the iteration count, for slow operations */
+    int storm;          /* poll presence from a second thread meanwhile */
+};
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cpu_time(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return ((uint64_t) usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000
+        + ((uint64_t) usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+static void *run_apdus(void *arg) {
+    struct worker *worker = arg;
+    SCARD_IO_HEADER pci = { SCARD_PROTOCOL_T0, 0 };
+    UCHAR response[MAX_BUFFER_SIZE];
+    int i;
+    for(i = 0; i < worker->iterations; i++) {
+        struct apdu *apdu = &mix[i % mix_length];
+        DWORD length = sizeof(response);
+        uint64_t start = now();
+        if(ifdh.transmit_to_icc(worker->lun, pci, apdu->bytes, apdu->length, response, &length, NULL) != IFD_SUCCESS) {
+            worker->errors++;
+        }
+        worker->samples.ns[worker->samples.count++] = now() - start;
+    }
+    return NULL;
+}
+
+static void *run_resets(void *arg) {
+    struct worker *worker = arg;
+    UCHAR atr[MAX_ATR_SIZE];
+    int i;
+    for(i = 0; i < worker->iterations; i++) {
+        DWORD length = sizeof(atr);
+        uint64_t start = now();
+        if(ifdh.power_icc(worker->lun, IFD_RESET, atr, &length) != IFD_SUCCESS) {
+            worker->errors++;
+        }
+        worker->samples.ns[worker->samples.count++] = now() - start;
+    }
+    return NULL;
+}
+
+static void *run_presence(void *arg) {
+    struct worker *worker = arg;
+    int i;
+    for(i = 0; i < worker->iterations; i++) {
+        uint64_t start = now();
+        if(ifdh.icc_presence(worker->lun) != IFD_ICC_PRESENT) {
+            worker->errors++;
+        }
+        worker->samples.ns[worker->samples.count++] = now() - start;
+    }
+    return NULL;
+}
+
+/* Stands in for pcscd's polling thread gone wild, until told to stop */
+static void *presence_storm(void *arg) {
+    struct worker *worker = arg;
+    while(!worker->stop) {
+        ifdh.icc_presence(worker->lun);
+    }
+    return NULL;
+}
+
+static const struct workload workloads[] = {
+    { "apdu", run_apdus, 1, 0 },
+    { "reset", run_resets, 10, 0 },
+    { "presence", run_presence, 1, 0 },
+    { "apdu+presence", run_apdus, 1, 1 },
+};
+
+/* Sum of the counters of all readers */
+static int read_metrics(int readers, uint64_t *apdus, uint64_t *transfers) {
+    int i, j;
+    *apdus = 0;
+    *transfers = 0;
+    for(i = 0; i < readers; i++) {
+        struct cr75_metrics metrics;
+        DWORD length;
+        if(ifdh.control(i << 16, IOCTL_CR75_METRICS, NULL, 0, (PUCHAR) &metrics, sizeof(metrics), &length) != IFD_SUCCESS) {
+            return -1;
+        }
+        for(j = 0; j < 8; j++) {
+            *apdus += metrics.apdus[j];
+        }
+        *transfers += metrics.control_transfers + metrics.bulk_transfers;
+    }
+    return 0;
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, size_t count, double p) {
+    size_t i = (size_t) (p * count);
+    if(i >= count) {
+        i = count - 1;
+    }
+    return sorted[i] / 1000.0;
+}
+
+/* Runs one workload on every reader at once and prints a JSON line */
+static int run_workload(const struct workload *workload, int readers, int iterations) {
+    struct worker workers[MAX_READERS];
+    struct worker storms[MAX_READERS];
+    uint64_t apdus_before, transfers_before, apdus_after, transfers_after;
+    int i;
+
+    iterations = iterations / workload->divisor > 0 ? iterations / workload->divisor : 1;
+    memset(workers, 0, sizeof(workers));
+    memset(storms, 0, sizeof(storms));
+    if(read_metrics(readers, &apdus_before, &transfers_before)) {
+        fprintf(stderr, "IOCTL_CR75_METRICS failed\n");
+        return -1;
+    }
+
+    uint64_t cpu = cpu_time();
+    uint64_t start = now();
+    for(i = 0; i < readers; i++) {
+        workers[i].lun = i << 16;
+        workers[i].iterations = iterations;
+        workers[i].samples.ns = malloc(iterations * sizeof(uint64_t));
+        if(!workers[i].samples.ns) {
+            return -1;
+        }
+        pthread_create(&workers[i].thread, NULL, workload->run, &workers[i]);
+        if(workload->storm) {
+            storms[i].lun = workers[i].lun;
+            pthread_create(&storms[i].thread, NULL, presence_storm, &storms[i]);
+        }
+    }
+    for(i = 0; i < readers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    uint64_t elapsed = now() - start;
+    for(i = 0; i < readers && workload->storm; i++) {
+        storms[i].stop = 1;
+        pthread_join(storms[i].thread, NULL);
+    }
+    cpu = cpu_time() - cpu;
+    read_metrics(readers, &apdus_after, &transfers_after);
+
+    size_t count = 0;
+    unsigned long errors = 0;
+    uint64_t *all = malloc(readers * iterations * sizeof(uint64_t));
+    if(!all) {
+        return -1;
+    }
+    for(i = 0; i < readers; i++) {
+        memcpy(&all[count], workers[i].samples.ns, workers[i].samples.count * sizeof(uint64_t));
+        count += workers[i].samples.count;
+        errors += workers[i].errors;
+        free(workers[i].samples.ns);
+    }
+    qsort(all, count, sizeof(uint64_t), compare);
+
+    // CPU includes the storm threads and, with CR75_EMULATOR, the card
+    printf("{\"workload\":\"%s\",\"readers\":%i,\"ops\":%zu,\"errors\":%lu,"
+           "\"seconds\":%.6f,\"ops_per_s\":%.1f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+           "\"apdus\":%llu,\"usb_transfers_per_op\":%.2f,\"cpu_us_per_op\":%.2f}\n",
+           workload->name, readers, count, errors,
+           elapsed / 1e9, count / (elapsed / 1e9),
+           percentile(all, count, 0.5), percentile(all, count, 0.99),
+           percentile(all, count, 0.999), all[count - 1] / 1000.0,
+           (unsigned long long) (apdus_after - apdus_before),
+           (double) (transfers_after - transfers_before) / count,
+           cpu / 1000.0 / count);
+    fflush(stdout);
+    free(all);
+    return 0;
+}
+
+static void *load(void *handle, const char *name) {
+    void *symbol = dlsym(handle, name);
+    if(!symbol) {
+        fprintf(stderr, "%s: %s\n", name, dlerror());
+        exit(1);
+    }
+    return symbol;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-d driver] [-e] [-r readers] [-n iterations] [workload...]\n"
+            "  -d  driver to load, default %s\n"
+            "  -e  run against the emulator (sets CR75_EMULATOR=1)\n"
+            "  -r  readers to use at once, default 1\n"
+            "  -n  operations per reader, default 1000 (100 resets)\n"
+            "workloads: apdu reset presence apdu+presence, default all\n",
+            argv0, CR75_DRIVER);
+}
+
+int main(int argc, char **argv) {
+    const char *driver = CR75_DRIVER;
+    int readers = 1;
+    int iterations = 1000;
+    int option;
+    int i;
+    size_t w;
+
+    while((option = getopt(argc, argv, "d:er:n:h")) != -1) {
+        switch(option) {
+            case 'd':
+                driver = optarg;
+                break;
+            case 'e':
+                setenv("CR75_EMULATOR", "1", 1);
+                break;
+            case 'r':
+                readers = atoi(optarg);
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if(readers < 1 || readers > MAX_READERS || iterations < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    void *handle = dlopen(driver, RTLD_NOW | RTLD_LOCAL);
+    if(!handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+    *(void **) &ifdh.create_channel = load(handle, "IFDHCreateChannel");
+    *(void **) &ifdh.close_channel = load(handle, "IFDHCloseChannel");
+    *(void **) &ifdh.power_icc = load(handle, "IFDHPowerICC");
+    *(void **) &ifdh.transmit_to_icc = load(handle, "IFDHTransmitToICC");
+    *(void **) &ifdh.icc_presence = load(handle, "IFDHICCPresence");
+    *(void **) &ifdh.control = load(handle, "IFDHControl");
+    build_mix();
+
+    int rv = 0;
+    for(i = 0; i < readers; i++) {
+        UCHAR atr[MAX_ATR_SIZE];
+        DWORD length = sizeof(atr);
+        if(ifdh.create_channel(i << 16, 0) != IFD_SUCCESS) {
+            fprintf(stderr, "No reader %i\n", i);
+            readers = i;
+            rv = 1;
+            goto close;
+        }
+        if(ifdh.power_icc(i << 16, IFD_POWER_UP, atr, &length) != IFD_SUCCESS) {
+            fprintf(stderr, "No card in reader %i\n", i);
+            readers = i + 1;
+            rv = 1;
+            goto close;
+        }
+    }
+
+    for(w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        int selected = optind == argc;
+        for(i = optind; i < argc; i++) {
+            selected |= !strcmp(argv[i], workloads[w].name);
+        }
+        if(selected && run_workload(&workloads[w], readers, iterations)) {
+            rv = 1;
+            break;
+        }
+    }
+
+close:
+    for(i = 0; i < readers; i++) {
+        ifdh.close_channel(i << 16);
+    }
+    dlclose(handle);
+    return rv;
+}
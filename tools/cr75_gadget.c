@@ -0,0 +1,429 @@
+/*****************************************************************
+/
+/ File   :   cr75_gadget.c
+/ Date   :   October 16, 2026
+/ Purpose:   Virtual CR-75 on Linux raw-gadget, usually over dummy_hcd,
+/            backed by the emulator, so the unmodified driver and libusb
+/            can be run and benchmarked without the hardware.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#define _DEFAULT_SOURCE /* htole16() */
+
+#include "../emulator.h"
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define VENDOR_ID 0x1307
+#define PRODUCT_ID 0x0361
+#define PACKET_SIZE EMULATOR_PACKET_SIZE
+#define EP0_MAX_DATA 4096
+
+enum { STRING_MANUFACTURER = 1, STRING_PRODUCT, STRING_SERIAL };
+
+static const char *strings[] = { NULL, "Transcend", "CR-75 (raw-gadget)", "000000000001" };
+
+static const struct usb_device_descriptor device_descriptor = {
+    .bLength = USB_DT_DEVICE_SIZE,
+    .bDescriptorType = USB_DT_DEVICE,
+    .bcdUSB = 0x0200,
+    .bDeviceClass = 0,
+    .bMaxPacketSize0 = 64,
+    .idVendor = VENDOR_ID,
+    .idProduct = PRODUCT_ID,
+    .bcdDevice = 0x0100,
+    .iManufacturer = STRING_MANUFACTURER,
+    .iProduct = STRING_PRODUCT,
+    .iSerialNumber = STRING_SERIAL,
+    .bNumConfigurations = 1,
+};
+
+/* Interface 0 stands in for the card reader's storage function, the driver
+   claims interface 1 */
+static const struct usb_interface_descriptor interfaces[] = {
+    {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = 0,
+        .bNumEndpoints = 0,
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+    },
+    {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = 1,
+        .bNumEndpoints = 3,
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+    },
+};
+
+static const struct usb_endpoint_descriptor endpoints[] = {
+    {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = 0x05,
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize = PACKET_SIZE,
+    },
+    {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = 0x86,
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize = PACKET_SIZE,
+    },
+    {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = 0x84,
+        .bmAttributes = USB_ENDPOINT_XFER_INT,
+        .wMaxPacketSize = 8,
+        .bInterval = 10,
+    },
+};
+
+static struct {
+    int fd;
+    struct emulator emulator;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     /* the card sent bytes or was moved */
+    int handles[3];             /* of endpoints[] */
+    int configured;
+} gadget = { -1, .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+/* Endpoint I/O with the data right behind the header, as raw-gadget wants */
+static int ep_io(unsigned long request, int ep, void *data, size_t length) {
+    struct usb_raw_ep_io *io = malloc(sizeof(*io) + length);
+    if(!io) {
+        return -ENOMEM;
+    }
+    io->ep = ep;
+    io->flags = 0;
+    io->length = length;
+    if(request == USB_RAW_IOCTL_EP_WRITE || request == USB_RAW_IOCTL_EP0_WRITE) {
+        memcpy(io->data, data, length);
+    }
+    int rv = ioctl(gadget.fd, request, io);
+    if(rv > 0 && (request == USB_RAW_IOCTL_EP_READ || request == USB_RAW_IOCTL_EP0_READ)) {
+        memcpy(data, io->data, rv);
+    }
+    free(io);
+    return rv < 0 ? -errno : rv;
+}
+
+static void *bulk_out(void *arg) {
+    unsigned char data[PACKET_SIZE];
+    (void) arg;
+    for(;;) {
+        int length = ep_io(USB_RAW_IOCTL_EP_READ, gadget.handles[0], data, sizeof(data));
+        if(length < 0) {
+            break;
+        }
+        int transferred;
+        pthread_mutex_lock(&gadget.lock);
+        emulator_bulk(&gadget.emulator, 0x05, data, length, &transferred);
+        pthread_cond_broadcast(&gadget.changed);
+        pthread_mutex_unlock(&gadget.lock);
+    }
+    return NULL;
+}
+
+/* Queues a packet on 0x86 as soon as the card has sent something the
+   driver announced with request 193 */
+static void *bulk_in(void *arg) {
+    unsigned char data[PACKET_SIZE];
+    (void) arg;
+    for(;;) {
+        int transferred;
+        pthread_mutex_lock(&gadget.lock);
+        while(!gadget.emulator.queue_length || !gadget.emulator.in_expected) {
+            pthread_cond_wait(&gadget.changed, &gadget.lock);
+        }
+        emulator_bulk(&gadget.emulator, 0x86, data, sizeof(data), &transferred);
+        pthread_mutex_unlock(&gadget.lock);
+        if(ep_io(USB_RAW_IOCTL_EP_WRITE, gadget.handles[1], data, transferred) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *interrupt_in(void *arg) {
+    (void) arg;
+    for(;;) {
+        uint8_t status;
+        pthread_mutex_lock(&gadget.lock);
+        while(!emulator_interrupt(&gadget.emulator, &status)) {
+            pthread_cond_wait(&gadget.changed, &gadget.lock);
+        }
+        pthread_mutex_unlock(&gadget.lock);
+        if(ep_io(USB_RAW_IOCTL_EP_WRITE, gadget.handles[2], &status, 1) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static size_t config_descriptor(uint8_t *buffer) {
+    struct usb_config_descriptor config = {
+        .bLength = USB_DT_CONFIG_SIZE,
+        .bDescriptorType = USB_DT_CONFIG,
+        .bNumInterfaces = 2,
+        .bConfigurationValue = 1,
+        .bmAttributes = USB_CONFIG_ATT_ONE,
+        .bMaxPower = 50,
+    };
+    size_t length = USB_DT_CONFIG_SIZE;
+    size_t i;
+    for(i = 0; i < 2; i++) {
+        memcpy(&buffer[length], &interfaces[i], USB_DT_INTERFACE_SIZE);
+        length += USB_DT_INTERFACE_SIZE;
+    }
+    for(i = 0; i < 3; i++) {
+        struct usb_endpoint_descriptor endpoint = endpoints[i];
+        endpoint.wMaxPacketSize = htole16(endpoint.wMaxPacketSize);
+        memcpy(&buffer[length], &endpoint, USB_DT_ENDPOINT_SIZE);
+        length += USB_DT_ENDPOINT_SIZE;
+    }
+    config.wTotalLength = htole16(length);
+    memcpy(buffer, &config, USB_DT_CONFIG_SIZE);
+    return length;
+}
+
+static int string_descriptor(int index, uint8_t *buffer) {
+    if(index == 0) {
+        static const uint8_t languages[] = { 4, USB_DT_STRING, 0x09, 0x04 }; // en-US
+        memcpy(buffer, languages, sizeof(languages));
+        return sizeof(languages);
+    }
+    if(index >= (int) (sizeof(strings) / sizeof(strings[0]))) {
+        return -1;
+    }
+    size_t length = strlen(strings[index]);
+    size_t i;
+    buffer[0] = 2 + 2 * length;
+    buffer[1] = USB_DT_STRING;
+    for(i = 0; i < length; i++) {
+        buffer[2 + 2 * i] = strings[index][i];
+        buffer[3 + 2 * i] = 0;
+    }
+    return buffer[0];
+}
+
+static int configure(void) {
+    static pthread_t threads[3];
+    static void *(*const run[3])(void *) = { bulk_out, bulk_in, interrupt_in };
+    int i;
+    if(gadget.configured) {
+        return 0;
+    }
+    for(i = 0; i < 3; i++) {
+        struct usb_endpoint_descriptor endpoint = endpoints[i];
+        endpoint.wMaxPacketSize = htole16(endpoint.wMaxPacketSize);
+        gadget.handles[i] = ioctl(gadget.fd, USB_RAW_IOCTL_EP_ENABLE, &endpoint);
+        if(gadget.handles[i] < 0) {
+            perror("USB_RAW_IOCTL_EP_ENABLE");
+            return -1;
+        }
+    }
+    ioctl(gadget.fd, USB_RAW_IOCTL_VBUS_DRAW, 100);
+    ioctl(gadget.fd, USB_RAW_IOCTL_CONFIGURE, 0);
+    for(i = 0; i < 3; i++) {
+        pthread_create(&threads[i], NULL, run[i], NULL);
+        pthread_detach(threads[i]);
+    }
+    gadget.configured = 1;
+    return 0;
+}
+
+/* Answers a standard or vendor request on ep0. Returns the number of bytes
+   to send for IN requests, 0 to acknowledge OUT ones, -1 to stall. */
+static int control(const struct usb_ctrlrequest *setup, uint8_t *data) {
+    uint16_t value = le16toh(setup->wValue);
+    uint16_t index = le16toh(setup->wIndex);
+    uint16_t length = le16toh(setup->wLength);
+
+    if((setup->bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR) {
+        if(!(setup->bRequestType & USB_DIR_IN) && length) {
+            if(ep_io(USB_RAW_IOCTL_EP0_READ, 0, data, length) < 0) {
+                return -1;
+            }
+        }
+        pthread_mutex_lock(&gadget.lock);
+        int rv = emulator_control(&gadget.emulator, setup->bRequestType, setup->bRequest, index, data, length);
+        pthread_cond_broadcast(&gadget.changed);
+        pthread_mutex_unlock(&gadget.lock);
+        if(rv < 0) {
+            return -1;
+        }
+        if(!(setup->bRequestType & USB_DIR_IN)) {
+            // The data stage, if any, already acknowledged the request
+            return length ? -2 : 0;
+        }
+        return rv;
+    }
+    if((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD) {
+        return -1;
+    }
+
+    switch(setup->bRequest) {
+        case USB_REQ_GET_DESCRIPTOR:
+            switch(value >> 8) {
+                case USB_DT_DEVICE: {
+                    struct usb_device_descriptor descriptor = device_descriptor;
+                    descriptor.bcdUSB = htole16(descriptor.bcdUSB);
+                    descriptor.idVendor = htole16(descriptor.idVendor);
+                    descriptor.idProduct = htole16(descriptor.idProduct);
+                    descriptor.bcdDevice = htole16(descriptor.bcdDevice);
+                    memcpy(data, &descriptor, USB_DT_DEVICE_SIZE);
+                    return USB_DT_DEVICE_SIZE;
+                }
+                case USB_DT_CONFIG:
+                    return config_descriptor(data);
+                case USB_DT_STRING:
+                    return string_descriptor(value & 0xFF, data);
+                default:
+                    return -1;
+            }
+        case USB_REQ_SET_CONFIGURATION:
+            return configure();
+        case USB_REQ_GET_CONFIGURATION:
+            data[0] = gadget.configured;
+            return 1;
+        case USB_REQ_SET_INTERFACE:
+            return 0;
+        case USB_REQ_GET_INTERFACE:
+            data[0] = 0;
+            return 1;
+        case USB_REQ_GET_STATUS:
+            data[0] = 0;
+            data[1] = 0;
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+static void *ep0_loop(void *arg) {
+    struct usb_raw_event *event = malloc(sizeof(*event) + sizeof(struct usb_ctrlrequest));
+    uint8_t *data = malloc(EP0_MAX_DATA);
+    (void) arg;
+    if(!event || !data) {
+        exit(1);
+    }
+
+    for(;;) {
+        event->type = 0;
+        event->length = sizeof(struct usb_ctrlrequest);
+        if(ioctl(gadget.fd, USB_RAW_IOCTL_EVENT_FETCH, event) < 0) {
+            perror("USB_RAW_IOCTL_EVENT_FETCH");
+            exit(1);
+        }
+        if(event->type != USB_RAW_EVENT_CONTROL) {
+            continue;
+        }
+
+        const struct usb_ctrlrequest *setup = (const struct usb_ctrlrequest *) event->data;
+        uint16_t length = le16toh(setup->wLength);
+        memset(data, 0, EP0_MAX_DATA);
+        int rv = length <= EP0_MAX_DATA ? control(setup, data) : -1;
+        if(rv == -1) {
+            ioctl(gadget.fd, USB_RAW_IOCTL_EP0_STALL, 0);
+        } else if(setup->bRequestType & USB_DIR_IN) {
+            ep_io(USB_RAW_IOCTL_EP0_WRITE, 0, data, rv < length ? rv : length);
+        } else if(rv == 0) {
+            ep_io(USB_RAW_IOCTL_EP0_READ, 0, data, 0);
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-d driver] [-u device]\n"
+            "  -d  UDC driver, default dummy_udc\n"
+            "  -u  UDC device, default dummy_udc.0\n"
+            "SIGUSR1 inserts the card, SIGUSR2 removes it. The card is\n"
+            "configured with the CR75_EMULATOR_* environment variables.\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    const char *driver = "dummy_udc";
+    const char *device = "dummy_udc.0";
+    int option;
+
+    while((option = getopt(argc, argv, "d:u:h")) != -1) {
+        switch(option) {
+            case 'd':
+                driver = optarg;
+                break;
+            case 'u':
+                device = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    struct emulator_config config;
+    emulator_config_from_env(&config);
+    if(emulator_init(&gadget.emulator, &config)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Signals are only taken by sigwait() below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    gadget.fd = open("/dev/raw-gadget", O_RDWR);
+    if(gadget.fd < 0) {
+        perror("/dev/raw-gadget");
+        return 1;
+    }
+    struct usb_raw_init init;
+    memset(&init, 0, sizeof(init));
+    strncpy((char *) init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+    strncpy((char *) init.device_name, device, UDC_NAME_LENGTH_MAX - 1);
+    init.speed = USB_SPEED_FULL;
+    if(ioctl(gadget.fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl(gadget.fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+        perror("raw-gadget");
+        return 1;
+    }
+
+    pthread_t ep0;
+    pthread_create(&ep0, NULL, ep0_loop, NULL);
+
+    // Closing the raw-gadget file on exit unplugs the device
+    for(;;) {
+        int signal;
+        sigwait(&signals, &signal);
+        if(signal == SIGINT || signal == SIGTERM) {
+            break;
+        }
+        pthread_mutex_lock(&gadget.lock);
+        emulator_insert(&gadget.emulator, signal == SIGUSR1);
+        pthread_cond_broadcast(&gadget.changed);
+        pthread_mutex_unlock(&gadget.lock);
+    }
+    close(gadget.fd);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*****************************************************************
+/
+/ File   :   trace.c
+/ Date   :   October 16, 2026
+/ Purpose:   Per-reader ring of binary USB trace records.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "reader.h"
+#include <string.h>
+#include <unistd.h>
+
+/* Records are only formatted when dumped, adding one costs a clock read and
+   a short copy. Each slot is a small seqlock, so dumping never blocks the
+   transmitting thread and skips records that are being overwritten. */
+void trace_add(struct trace *trace, uint8_t direction, uint8_t endpoint, const UCHAR *data, size_t length) {
+    if(!__atomic_load_n(&trace->enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    uint64_t index = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    struct trace_record *record = &trace->records[index & (TRACE_RECORDS - 1)];
+
+    __atomic_store_n(&record->seq, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->time = metrics_now();
+    record->length = (length > 0xFFFF) ? 0xFFFF : length;
+    record->direction = direction;
+    record->endpoint = endpoint;
+    memcpy(record->data, data, (length < TRACE_DATA) ? length : TRACE_DATA);
+    __atomic_store_n(&record->seq, 2 * index + 2, __ATOMIC_RELEASE);
+}
+
+/* Copies record index if it still holds it, returns 0 otherwise */
+static int trace_read(const struct trace *trace, uint64_t index, struct trace_record *copy) {
+    const struct trace_record *record = &trace->records[index & (TRACE_RECORDS - 1)];
+    uint64_t seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+    if(seq != 2 * index + 2) {
+        return 0;
+    }
+    memcpy(copy, record, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* Appends value in decimal, zero padded to width */
+static char *put_decimal(char *out, uint64_t value, int width) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    while(width-- > n) {
+        *out++ = '0';
+    }
+    while(n) {
+        *out++ = digits[--n];
+    }
+    return out;
+}
+
+static char *put_hex(char *out, uint8_t value) {
+    static const char hex[] = "0123456789ABCDEF";
+    *out++ = hex[value >> 4];
+    *out++ = hex[value & 0x0F];
+    return out;
+}
+
+/* Formats one record like log_command did, with a monotonic timestamp:
+   "seconds.nanoseconds > EP length XX XX .. [ascii]". Uses no libc
+   formatting, so it can run in a signal handler. */
+static size_t trace_format_record(const struct trace_record *record, char *line) {
+    char *out = line;
+    size_t kept = (record->length < TRACE_DATA) ? record->length : TRACE_DATA;
+    size_t i;
+
+    out = put_decimal(out, record->time / 1000000000ULL, 1);
+    *out++ = '.';
+    out = put_decimal(out, record->time % 1000000000ULL, 9);
+    *out++ = ' ';
+    *out++ = record->direction;
+    *out++ = ' ';
+    out = put_hex(out, record->endpoint);
+    *out++ = ' ';
+    out = put_decimal(out, record->length, 1);
+    for(i = 0; i < kept; i++) {
+        *out++ = ' ';
+        out = put_hex(out, record->data[i]);
+    }
+    if(kept < record->length) {
+        *out++ = ' ';
+        *out++ = '.';
+        *out++ = '.';
+    }
+    *out++ = ' ';
+    *out++ = '[';
+    for(i = 0; i < kept; i++) {
+        *out++ = (record->data[i] >= 0x20 && record->data[i] < 0x7F) ? record->data[i] : '.';
+    }
+    *out++ = ']';
+    *out++ = '\n';
+    return out - line;
+}
+
+/* Calls emit for every record still in the ring, oldest first */
+static int trace_each(const struct trace *trace, int (*emit)(void *context, const char *line, size_t length), void *context) {
+    uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    uint64_t index = (head > TRACE_RECORDS) ? head - TRACE_RECORDS : 0;
+    for(; index < head; index++) {
+        struct trace_record record;
+        char line[TRACE_LINE_SIZE];
+        if(!trace_read(trace, index, &record)) {
+            continue;
+        }
+        if(emit(context, line, trace_format_record(&record, line))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct trace_buffer {
+    char *out;
+    size_t length;
+    size_t capacity;
+};
+
+static int emit_buffer(void *context, const char *line, size_t length) {
+    struct trace_buffer *buffer = context;
+    if(buffer->capacity - buffer->length < length) {
+        return -1;
+    }
+    memcpy(&buffer->out[buffer->length], line, length);
+    buffer->length += length;
+    return 0;
+}
+
+/* Formats the ring into out as text lines, stops at the first line that
+   doesn't fit. Returns the number of bytes written. */
+size_t trace_format(const struct trace *trace, char *out, size_t capacity) {
+    struct trace_buffer buffer = { out, 0, capacity };
+    trace_each(trace, emit_buffer, &buffer);
+    return buffer.length;
+}
+
+static int emit_fd(void *context, const char *line, size_t length) {
+    int fd = *(int *) context;
+    while(length) {
+        ssize_t written = write(fd, line, length);
+        if(written <= 0) {
+            return -1;
+        }
+        line += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* Writes the ring to fd, async-signal-safe */
+int trace_write(const struct trace *trace, int fd) {
+    return trace_each(trace, emit_fd, &fd);
+}
@@ -0,0 +1,43 @@
+/*****************************************************************
+/
+/ File   :   trace.h
+/ Date   :   October 16, 2026
+/ Purpose:   Per-reader ring of binary USB trace records.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _trace_h_
+#define _trace_h_
+
+#include "ifdhandler.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_RECORDS 256 /* power of 2 */
+#define TRACE_DATA 20 /* bytes of every transfer kept */
+#define TRACE_LINE_SIZE (56 + 4 * TRACE_DATA) /* longest line trace_format writes */
+
+#define TRACE_OUT '>'
+#define TRACE_IN '<'
+
+struct trace_record {
+    uint64_t seq;       /* 2 * index + 2 once written, odd while being written */
+    uint64_t time;      /* metrics_now() */
+    uint16_t length;    /* full length of the transfer */
+    uint8_t direction;  /* TRACE_OUT or TRACE_IN */
+    uint8_t endpoint;   /* 0 for vendor requests, which go in data[0] */
+    uint8_t data[TRACE_DATA];
+};
+
+struct trace {
+    int enabled;        /* TAG_CR75_TRACE */
+    uint64_t head;      /* index of the next record */
+    struct trace_record records[TRACE_RECORDS];
+};
+
+void trace_add(struct trace *trace, uint8_t direction, uint8_t endpoint, const UCHAR *data, size_t length);
+size_t trace_format(const struct trace *trace, char *out, size_t capacity);
+int trace_write(const struct trace *trace, int fd);
+
+#endif
@@ -0,0 +1,76 @@
+/*****************************************************************
+/
+/ File   :   transport.h
+/ Date   :   October 16, 2026
+/ Purpose:   Interface between the protocol code and whatever carries
+/            the CR-75 vendor requests: libusb, a recorded transcript
+/            or an emulator.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#ifndef _transport_h_
+#define _transport_h_
+
+#include "ifdhandler.h"
+#include <stdint.h>
+#include <pthread.h>
+
+#define MAX_PORT_DEPTH 7 /* USB 3.0 limits hub chains to 7 ports */
+
+/* Which device IFDHCreateChannelByName asked for, -1 fields match anything */
+struct device_match {
+    int bus;
+    int address;
+    uint8_t ports[MAX_PORT_DEPTH];
+    int port_count;
+};
+
+struct reader;
+struct emulator;
+
+/* Transfer functions return like their libusb counterparts, the number of
+   bytes or 0 on success and a LIBUSB_ERROR code on failure. Timeouts are
+   in ms and computed by the driver from the card's waiting times. */
+struct transport {
+    const char *name;
+
+    /* Opens the reader described by match, sets in_packet_size and
+       card_present and starts reporting card insertion and removal */
+    RESPONSECODE (*open)(struct reader *reader, const struct device_match *match);
+    void (*close)(struct reader *reader);
+
+    /* Vendor request: 0x40 type requests send data, 0xc0 type receive it */
+    int (*control)(struct reader *reader, uint8_t type, uint8_t request, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout);
+    /* Bulk transfer on 0x05 (OUT) or 0x86 (IN) */
+    int (*bulk)(struct reader *reader, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+    /* Sends a whole message as 16-byte bulk OUT chunks with several of them
+       in flight, each given timeout ms. NULL if the transport has no use
+       for that */
+    RESPONSECODE (*write_async)(struct reader *reader, PUCHAR msg, size_t length, unsigned int timeout);
+    /* Submits a bulk IN on 0x86 into data without waiting for it, so it is
+       pending before the response is requested. The next bulk() on 0x86
+       with the same data and length waits for it instead of starting a
+       transfer, data NULL cancels it. NULL if the transport has no use for
+       that */
+    int (*arm_in)(struct reader *reader, unsigned char *data, int length, unsigned int timeout);
+
+    /* Delivers card presence changes until *completed is set or timeout ms
+       passed, 0 only handles what is pending and -1 waits indefinitely */
+    int (*wait)(struct reader *reader, int timeout, int *completed);
+    /* Makes a wait() running on another thread return early */
+    void (*interrupt)(struct reader *reader);
+};
+
+extern const struct transport usb_transport;
+extern const struct transport record_transport;
+extern const struct transport replay_transport;
+#ifdef WITH_EMULATOR
+extern const struct transport emulator_transport;
+RESPONSECODE emulator_transport_insert(struct reader *reader, int present);
+struct emulator *emulator_transport_emulator(struct reader *reader);
+#endif
+
+void transport_sleep(pthread_cond_t *wake, pthread_mutex_t *lock, int timeout);
+
+#endif
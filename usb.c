@@ -0,0 +1,455 @@
+/*****************************************************************
+/
+/ File   :   usb.c
+/ Date   :   October 16, 2026
+/ Purpose:   Transport to a real CR-75 through libusb.
+/ License:   See file COPYING
+/
+******************************************************************/
+
+#include "reader.h"
+#include "timeline.h"
+#include <syslog.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define VENDOR_ID 0x1307
+#define PRODUCT_ID 0x0361
+#define INTERFACE 1
+
+static int submit_transfer(struct libusb_transfer *transfer) {
+    int err = libusb_submit_transfer(transfer);
+    switch(err) {
+        case 0:
+            break;
+        case LIBUSB_ERROR_NO_DEVICE:
+            syslog(LOG_ERR, "Device not connected");
+            break;
+        default:
+            syslog(LOG_ERR, "Error %i while monitoring card status", err);
+    }
+    return err;
+}
+
+static void LIBUSB_CALL MonitorCardPresence(struct libusb_transfer *transfer) {
+    struct reader *reader = transfer->user_data;
+    switch(transfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            if(submit_transfer(transfer) < 0) {
+                ATOMIC_STORE(reader->monitoring, 0);
+            }
+            return;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            set_card_present(reader, 0);
+            // fall through
+        default:
+            // Cancelled by IFDHCloseChannel or the reader is gone
+            ATOMIC_STORE(reader->monitoring, 0);
+            return;
+    }
+
+    if(transfer->buffer[0] == 0x01) {
+        syslog(LOG_INFO, "Card detected");
+        set_card_present(reader, 1);
+    } else {
+        syslog(LOG_INFO, "Card not present");
+        set_card_present(reader, 0);
+        // Don't let a response that will never come hold up the reader. A
+        // transfer submitted after this sees card_removed and cancels itself.
+        if(!ATOMIC_LOAD(reader->bulk_completed)) {
+            libusb_cancel_transfer(reader->bulk);
+        }
+        if(!ATOMIC_LOAD(reader->in_completed)) {
+            libusb_cancel_transfer(reader->in);
+        }
+        int i;
+        for(i = 0; i < ASYNC_DEPTH; i++) {
+            if(!ATOMIC_LOAD(reader->out_completed[i])) {
+                libusb_cancel_transfer(reader->out[i]);
+            }
+        }
+    }
+    if(submit_transfer(transfer) < 0) {
+        ATOMIC_STORE(reader->monitoring, 0);
+    }
+}
+
+static int device_in_use(uint8_t bus, uint8_t address) {
+    int i;
+    for(i = 0; i < MAX_READERS; i++) {
+        if(readers[i].in_use && readers[i].handle && readers[i].bus == bus && readers[i].address == address) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int device_matches(libusb_device *device, const struct device_match *match) {
+    struct libusb_device_descriptor desc;
+    if(libusb_get_device_descriptor(device, &desc) || desc.idVendor != VENDOR_ID || desc.idProduct != PRODUCT_ID) {
+        return 0;
+    }
+
+    uint8_t bus = libusb_get_bus_number(device);
+    uint8_t address = libusb_get_device_address(device);
+    if((match->bus >= 0 && match->bus != bus) || (match->address >= 0 && match->address != address)) {
+        return 0;
+    }
+    if(match->port_count > 0) {
+        uint8_t ports[MAX_PORT_DEPTH];
+        int port_count = libusb_get_port_numbers(device, ports, sizeof(ports));
+        if(port_count != match->port_count || memcmp(ports, match->ports, port_count)) {
+            return 0;
+        }
+    }
+    return !device_in_use(bus, address);
+}
+
+/* Opens the first CR-75 that satisfies match and is not yet claimed by
+   another Lun, and starts monitoring its card slot. */
+static RESPONSECODE usb_open(struct reader *reader, const struct device_match *match) {
+    int err = libusb_init(&reader->ctx);
+    if(err) {
+        syslog(LOG_ERR, "Error %i while initializing device", err);
+        reader->ctx = NULL;
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    libusb_device **devices;
+    ssize_t count = libusb_get_device_list(reader->ctx, &devices);
+    if(count < 0) {
+        syslog(LOG_ERR, "Error %i while listing devices", (int) count);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    ssize_t i;
+    for(i = 0; i < count; i++) {
+        if(device_matches(devices[i], match)) {
+            err = libusb_open(devices[i], &reader->handle);
+            if(err) {
+                syslog(LOG_ERR, "Error %i while opening device", err);
+                reader->handle = NULL;
+            } else {
+                reader->bus = libusb_get_bus_number(devices[i]);
+                reader->address = libusb_get_device_address(devices[i]);
+                break;
+            }
+        }
+    }
+    libusb_free_device_list(devices, 1);
+
+    if(!reader->handle) {
+        syslog(LOG_ERR, "Unable to obtain handle");
+        return IFD_NO_SUCH_DEVICE;
+    }
+
+    err = libusb_claim_interface(reader->handle, INTERFACE);
+    if(err) {
+        syslog(LOG_ERR, "Error %i while claiming interface", err);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    int packet_size = libusb_get_max_packet_size(libusb_get_device(reader->handle), 0x86);
+    reader->in_packet_size = (packet_size > 0) ? packet_size : BUFFER_SIZE;
+
+    unsigned char *buffer = malloc(1 * sizeof(unsigned char));
+    reader->transfer = libusb_alloc_transfer(0);
+    reader->bulk = libusb_alloc_transfer(0);
+    reader->in = libusb_alloc_transfer(0);
+    reader->bulk_completed = 1;
+    reader->in_completed = 1;
+    int allocated = buffer && reader->transfer && reader->bulk && reader->in;
+    for(i = 0; i < ASYNC_DEPTH; i++) {
+        reader->out[i] = libusb_alloc_transfer(0);
+        reader->out_completed[i] = 1;
+        allocated = allocated && reader->out[i];
+    }
+    if (!allocated) {
+        free(buffer);
+        return IFD_COMMUNICATION_ERROR;
+    }
+    reader->transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    libusb_fill_interrupt_transfer(reader->transfer, reader->handle, 0x84, buffer, 1, MonitorCardPresence, reader, 0);
+    ATOMIC_STORE(reader->monitoring, submit_transfer(reader->transfer) == 0);
+
+    syslog(LOG_INFO, "Opened reader at bus %i, address %i", reader->bus, reader->address);
+    return IFD_SUCCESS;
+}
+
+static void usb_close(struct reader *reader) {
+    if(reader->transfer) {
+        if(ATOMIC_LOAD(reader->monitoring)) {
+            libusb_cancel_transfer(reader->transfer);
+            while(ATOMIC_LOAD(reader->monitoring)) {
+                if(libusb_handle_events(reader->ctx) < 0) {
+                    break;
+                }
+            }
+        }
+        libusb_free_transfer(reader->transfer);
+    }
+    if(reader->bulk) {
+        libusb_free_transfer(reader->bulk);
+    }
+    int i;
+    for(i = 0; i < ASYNC_DEPTH; i++) {
+        if(reader->out[i]) {
+            libusb_free_transfer(reader->out[i]);
+        }
+    }
+    if(reader->in) {
+        if(!reader->in_completed) {
+            libusb_cancel_transfer(reader->in);
+            while(!reader->in_completed && libusb_handle_events_completed(reader->ctx, &reader->in_completed) >= 0);
+        }
+        libusb_free_transfer(reader->in);
+    }
+
+    if(reader->handle) {
+        libusb_release_interface(reader->handle, INTERFACE);
+        libusb_close(reader->handle);
+    }
+    if(reader->ctx) {
+        libusb_exit(reader->ctx);
+    }
+}
+
+static int transfer_status_to_libusb_error(enum libusb_transfer_status status) {
+    switch(status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return LIBUSB_SUCCESS;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return LIBUSB_ERROR_INTERRUPTED;
+        case LIBUSB_TRANSFER_ERROR:
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
+
+struct async_write {
+    struct reader *reader;
+    PUCHAR msg;
+    size_t length;
+    size_t queued;  /* bytes handed to libusb so far */
+    int depth;
+    unsigned int timeout; /* per chunk */
+    int in_flight;
+    int error;      /* first libusb error, stops queueing further chunks */
+    int completed;
+    uint64_t started[ASYNC_DEPTH]; /* timeline_begin() of the chunk each transfer carries */
+};
+
+static void cancel_async_write(struct async_write *write) {
+    int i;
+    for(i = 0; i < write->depth; i++) {
+        if(!ATOMIC_LOAD(write->reader->out_completed[i])) {
+            libusb_cancel_transfer(write->reader->out[i]);
+        }
+    }
+}
+
+static void LIBUSB_CALL WriteChunkCompleted(struct libusb_transfer *transfer);
+
+static int transfer_slot(struct async_write *write, struct libusb_transfer *transfer) {
+    int i;
+    for(i = 0; i < write->depth && write->reader->out[i] != transfer; i++);
+    return i;
+}
+
+static int queue_chunk(struct async_write *write, int slot) {
+    struct libusb_transfer *transfer = write->reader->out[slot];
+    size_t bytes_remaining = write->length - write->queued;
+    int msg_length = (bytes_remaining < BUFFER_SIZE) ? bytes_remaining : BUFFER_SIZE;
+    libusb_fill_bulk_transfer(transfer, write->reader->handle, 0x05, &write->msg[write->queued], msg_length, WriteChunkCompleted, write, write->timeout);
+
+    METRICS_INC(write->reader, bulk_transfers);
+    trace_add(&write->reader->trace, TRACE_OUT, 0x05, transfer->buffer, msg_length);
+    write->started[slot] = timeline_begin();
+    ATOMIC_STORE(write->reader->out_completed[slot], 0);
+    int err = libusb_submit_transfer(transfer);
+    if(err < 0) {
+        ATOMIC_STORE(write->reader->out_completed[slot], 1);
+        metrics_usb_error(write->reader, err);
+        return err;
+    }
+    write->queued += msg_length;
+    write->in_flight++;
+    return 0;
+}
+
+static void LIBUSB_CALL WriteChunkCompleted(struct libusb_transfer *transfer) {
+    struct async_write *write = transfer->user_data;
+    int slot = transfer_slot(write, transfer);
+    ATOMIC_STORE(write->reader->out_completed[slot], 1);
+    write->in_flight--;
+    METRICS_ADD(write->reader, bytes_out, transfer->actual_length);
+    timeline_end("bulk OUT async", write->reader - readers, write->started[slot], "length", transfer->length);
+
+    if(transfer->status != LIBUSB_TRANSFER_COMPLETED && !write->error) {
+        write->error = transfer_status_to_libusb_error(transfer->status);
+        metrics_usb_error(write->reader, write->error);
+        cancel_async_write(write);
+    }
+
+    // Chunks on the same endpoint complete in order, so the freed transfer
+    // can carry the next chunk without reordering the message.
+    if(!write->error && write->queued < write->length) {
+        int err = queue_chunk(write, slot);
+        if(err < 0) {
+            write->error = err;
+            cancel_async_write(write);
+        }
+    }
+
+    if(write->in_flight == 0) {
+        write->completed = 1;
+    }
+}
+
+static RESPONSECODE usb_write_async(struct reader *reader, PUCHAR msg, size_t length, unsigned int timeout) {
+    struct async_write write = { reader, msg, length, 0, 0, timeout, 0, 0, 0, { 0 } };
+
+    write.depth = (reader->async_depth < ASYNC_DEPTH) ? reader->async_depth : ASYNC_DEPTH;
+    int i;
+    for(i = 0; i < write.depth && write.queued < length; i++) {
+        write.error = queue_chunk(&write, i);
+        if(write.error) {
+            cancel_async_write(&write);
+            break;
+        }
+    }
+    if(write.in_flight == 0) {
+        write.completed = 1;
+    }
+    // A removal reported before the chunks were submitted cancels them
+    // here, MonitorCardPresence takes care of later ones
+    if(ATOMIC_LOAD(reader->card_removed)) {
+        cancel_async_write(&write);
+    }
+
+    while(!write.completed) {
+        int err = libusb_handle_events_completed(reader->ctx, &write.completed);
+        if(err < 0 && err != LIBUSB_ERROR_INTERRUPTED && !write.error) {
+            write.error = err;
+            cancel_async_write(&write);
+        }
+    }
+
+    CHECK_LIBUSB(write.error);
+    return IFD_SUCCESS;
+}
+
+static int usb_control(struct reader *reader, uint8_t type, uint8_t request, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout) {
+    return libusb_control_transfer(reader->handle, type, request, 0xffff, index, data, length, timeout);
+}
+
+static void LIBUSB_CALL BulkCompleted(struct libusb_transfer *transfer) {
+    ATOMIC_STORE(*(int *) transfer->user_data, 1);
+}
+
+/* Handles events until transfer completes, cancelling it on removal or
+   when event handling fails */
+static int complete_transfer(struct reader *reader, struct libusb_transfer *transfer, int *completed) {
+    if(ATOMIC_LOAD(reader->card_removed)) {
+        libusb_cancel_transfer(transfer);
+    }
+
+    while(!*completed) {
+        int err = libusb_handle_events_completed(reader->ctx, completed);
+        if(err < 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+            libusb_cancel_transfer(transfer);
+            while(!*completed && libusb_handle_events_completed(reader->ctx, completed) >= 0);
+            return err;
+        }
+    }
+    return transfer_status_to_libusb_error(transfer->status);
+}
+
+/* libusb_bulk_transfer() on reader->bulk, so that MonitorCardPresence can
+   cancel it when the card is removed. A removal reported before the
+   transfer was submitted cancels it right away. A bulk IN armed with
+   usb_arm_in() is taken instead, even if another thread handling events
+   has completed it already. */
+static int usb_bulk(struct reader *reader, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+    *transferred = 0;
+    if(endpoint == 0x86 && reader->in_armed && reader->in->buffer == data && reader->in->length == length) {
+        reader->in_armed = 0;
+        int err = complete_transfer(reader, reader->in, &reader->in_completed);
+        *transferred = reader->in->actual_length;
+        return err;
+    }
+
+    libusb_fill_bulk_transfer(reader->bulk, reader->handle, endpoint, data, length, BulkCompleted, &reader->bulk_completed, timeout);
+    ATOMIC_STORE(reader->bulk_completed, 0);
+    int err = libusb_submit_transfer(reader->bulk);
+    if(err < 0) {
+        ATOMIC_STORE(reader->bulk_completed, 1);
+        return err;
+    }
+    err = complete_transfer(reader, reader->bulk, &reader->bulk_completed);
+    *transferred = reader->bulk->actual_length;
+    return err;
+}
+
+/* Submits reader->in, which usb_bulk() picks up later. Only one is pending
+   at a time, data NULL cancels it. */
+static int usb_arm_in(struct reader *reader, unsigned char *data, int length, unsigned int timeout) {
+    reader->in_armed = 0;
+    if(!reader->in_completed) {
+        libusb_cancel_transfer(reader->in);
+        while(!reader->in_completed && libusb_handle_events_completed(reader->ctx, &reader->in_completed) >= 0);
+        if(!reader->in_completed) {
+            return LIBUSB_ERROR_BUSY;
+        }
+    }
+    if(!data) {
+        return 0;
+    }
+
+    libusb_fill_bulk_transfer(reader->in, reader->handle, 0x86, data, length, BulkCompleted, &reader->in_completed, timeout);
+    ATOMIC_STORE(reader->in_completed, 0);
+    int err = libusb_submit_transfer(reader->in);
+    if(err < 0) {
+        ATOMIC_STORE(reader->in_completed, 1);
+        return err;
+    }
+    reader->in_armed = 1;
+    return 0;
+}
+
+static int usb_wait(struct reader *reader, int timeout, int *completed) {
+    struct timeval tv = { 60, 0 };
+    if(timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+    }
+    return libusb_handle_events_timeout_completed(reader->ctx, &tv, completed);
+}
+
+static void usb_interrupt(struct reader *reader) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    libusb_interrupt_event_handler(reader->ctx);
+#endif
+}
+
+const struct transport usb_transport = {
+    "usb",
+    usb_open,
+    usb_close,
+    usb_control,
+    usb_bulk,
+    usb_write_async,
+    usb_arm_in,
+    usb_wait,
+    usb_interrupt
+};